@@ -18,3 +18,4 @@
 
 extern int alsa_oss_debug;
 extern snd_output_t *alsa_oss_debug_out;
+extern void alsa_oss_debug_init(void);
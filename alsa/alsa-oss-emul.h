@@ -44,11 +44,15 @@
 #define OSS_WAIT_EVENT_WRITE	(1<<1)
 #define OSS_WAIT_EVENT_ERROR	(1<<2)
 
+struct iovec;
+
 extern int lib_oss_pcm_open(const char *pathname, int flags, ...);
 extern int lib_oss_pcm_close(int fd);
 extern int lib_oss_pcm_nonblock(int fd, int nonblock);
 extern ssize_t lib_oss_pcm_read(int fd, void *buf, size_t count);
 extern ssize_t lib_oss_pcm_write(int fd, const void *buf, size_t count);
+extern ssize_t lib_oss_pcm_readv(int fd, const struct iovec *iov, int iovcnt);
+extern ssize_t lib_oss_pcm_writev(int fd, const struct iovec *iov, int iovcnt);
 extern void * lib_oss_pcm_mmap(void *start, size_t length, int prot, int flags, int fd, off_t offset);
 extern int lib_oss_pcm_munmap(void *start, size_t length);
 extern int lib_oss_pcm_ioctl(int fd, unsigned long int request, ...);
@@ -28,6 +28,8 @@
 #include <sys/poll.h>
 #include <sys/select.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -38,8 +40,11 @@
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "alsa-oss-emul.h"
+#include "fdtable.h"
 
 #ifndef ATTRIBUTE_UNUSED
 /** do not print warning (gcc) when function parameter is not used */
@@ -68,11 +73,55 @@
 
 static int (*_select)(int n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
 static int (*_poll)(struct pollfd *ufds, unsigned int nfds, int timeout);
+static int (*_ppoll)(struct pollfd *ufds, nfds_t nfds, const struct timespec *tmo, const sigset_t *sigmask);
+static int (*_pselect)(int n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct timespec *tmo, const sigset_t *sigmask);
+/*
+ * 32bit targets with a 32bit time_t also export the 64bit time entry
+ * points used by programs built with _TIME_BITS=64.
+ */
+#if defined(__TIMESIZE) && __TIMESIZE == 32
+#define TIME64_WRAPPERS 1
+#include <stdint.h>
+#include <endian.h>
+
+/* the layouts of glibc's struct __timespec64 and __timeval64 */
+struct oss_timespec64 {
+	int64_t tv_sec;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	int32_t pad;
+	int32_t tv_nsec;
+#else
+	int32_t tv_nsec;
+	int32_t pad;
+#endif
+};
+
+struct oss_timeval64 {
+	int64_t tv_sec;
+	int64_t tv_usec;
+};
+
+static int (*_ppoll64)(struct pollfd *ufds, nfds_t nfds, const struct oss_timespec64 *tmo, const sigset_t *sigmask);
+static int (*_pselect64)(int n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const struct oss_timespec64 *tmo, const sigset_t *sigmask);
+static int (*_select64)(int n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct oss_timeval64 *timeout);
+#else
+#define TIME64_WRAPPERS 0
+#endif
+
+static int (*_epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+static int (*_epoll_wait)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+static int (*_epoll_pwait)(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask);
 static int (*_open)(const char *file, int oflag, ...);
 static int (*_open64)(const char *file, int oflag, ...);
 static int (*_close)(int fd);
 static ssize_t (*_write)(int fd, const void *buf, size_t n);
 static ssize_t (*_read)(int fd, void *buf, size_t n);
+static ssize_t (*_writev)(int fd, const struct iovec *iov, int iovcnt);
+static ssize_t (*_readv)(int fd, const struct iovec *iov, int iovcnt);
+static ssize_t (*_pwrite)(int fd, const void *buf, size_t n, off_t offset);
+static ssize_t (*_pread)(int fd, void *buf, size_t n, off_t offset);
+static ssize_t (*_pwrite64)(int fd, const void *buf, size_t n, off64_t offset);
+static ssize_t (*_pread64)(int fd, void *buf, size_t n, off64_t offset);
 static int (*_ioctl)(int fd, unsigned long request, ...);
 static int (*_fcntl)(int fd, int cmd, ...);
 static void *(*_mmap)(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
@@ -85,6 +134,8 @@ typedef struct ops {
 	int (*close)(int fd);
 	ssize_t (*write)(int fd, const void *buf, size_t n);
 	ssize_t (*read)(int fd, void *buf, size_t n);
+	ssize_t (*writev)(int fd, const struct iovec *iov, int iovcnt);
+	ssize_t (*readv)(int fd, const struct iovec *iov, int iovcnt);
 	int (*ioctl)(int fd, unsigned long request, ...);
 	int (*fcntl)(int fd, int cmd, ...);
 	void *(*mmap)(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
@@ -99,24 +150,193 @@ typedef enum {
 
 static ops_t ops[FD_CLASSES];
 
-typedef struct {
+typedef struct fd {
 	fd_class_t class;
 	int oflags;
-	void *mmap_area;
 	int poll_fds;
+	struct fd *next;
 } fd_t;
 
+/* emulated mmap areas, open addressing keyed by the returned address */
+typedef struct {
+	void *addr;
+	int fd;				/* -1 once closed */
+} mmap_area_t;
+
 static void initialize(void);
-static int initialized = 0;
+static pthread_once_t initialize_once = PTHREAD_ONCE_INIT;
+static unsigned int epoll_sets_count;
+static void epoll_forget_set(int epfd);
+static void epoll_forget_dsp(int fd);
 
 static int oss_wrapper_debug = 0;
 static int open_max;
 static int poll_fds_add = 0;
-static fd_t **fds;
+static fd_table_t fds = FD_TABLE_INITIALIZER;
+static fd_t *free_fds;
+static pthread_mutex_t free_fds_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mmap_area_t *mmap_areas;
+static unsigned int mmap_areas_size;
+static unsigned int mmap_areas_count;
+static pthread_mutex_t mmap_areas_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Emulated dsp fds usable with select(), one bit per fd laid out like the
+ * words of an fd_set, so that select() can find them with a few ANDs.
+ */
+#define FDS_WORD_BITS	(8 * sizeof(unsigned long))
+#define FDS_WORDS(n)	(((n) + FDS_WORD_BITS - 1) / FDS_WORD_BITS)
+static unsigned long dsp_fds_bits[FDS_WORDS(FD_SETSIZE)];
+
+static inline fd_t *look_for_fd(int fd)
+{
+	return fd_table_get(&fds, fd);
+}
+
+static inline void dsp_fds_mark(int fd, int set)
+{
+	unsigned long bit = 1UL << (fd % FDS_WORD_BITS);
+
+	if (fd < 0 || fd >= FD_SETSIZE)
+		return;
+	if (set)
+		__atomic_or_fetch(&dsp_fds_bits[fd / FDS_WORD_BITS], bit, __ATOMIC_RELEASE);
+	else
+		__atomic_and_fetch(&dsp_fds_bits[fd / FDS_WORD_BITS], ~bit, __ATOMIC_RELEASE);
+}
 
 static inline int is_oss_device(int fd)
 {
-	return fd >= 0 && fd < open_max && fds[fd];
+	return look_for_fd(fd) != NULL;
+}
+
+static inline int is_oss_dsp_fd(int fd)
+{
+	fd_t *xfd = look_for_fd(fd);
+	return xfd && xfd->class == FD_OSS_DSP;
+}
+
+/*
+ * fd records are recycled but never freed, so that the wrappers can look
+ * them up without taking any lock or reference.
+ */
+static fd_t *alloc_fd(void)
+{
+	fd_t *xfd;
+
+	pthread_mutex_lock(&free_fds_mutex);
+	xfd = free_fds;
+	if (xfd)
+		free_fds = xfd->next;
+	pthread_mutex_unlock(&free_fds_mutex);
+	if (!xfd)
+		return calloc(1, sizeof(fd_t));
+	xfd->poll_fds = 0;
+	xfd->next = NULL;
+	return xfd;
+}
+
+static void release_fd(fd_t *xfd)
+{
+	pthread_mutex_lock(&free_fds_mutex);
+	xfd->next = free_fds;
+	free_fds = xfd;
+	pthread_mutex_unlock(&free_fds_mutex);
+}
+
+static inline unsigned int mmap_area_hash(void *addr)
+{
+	unsigned long v = (unsigned long)addr;
+	v ^= v >> 16;
+	v *= 0x45d9f3bUL;
+	v ^= v >> 16;
+	return v & (mmap_areas_size - 1);
+}
+
+/* mmap_area_*() are called with mmap_areas_mutex held */
+static int mmap_area_insert(void *addr, int fd)
+{
+	unsigned int k;
+
+	if ((mmap_areas_count + 1) * 2 > mmap_areas_size) {
+		mmap_area_t *old = mmap_areas;
+		unsigned int old_size = mmap_areas_size;
+		unsigned int size = old_size ? old_size * 2 : 16;
+		mmap_areas = calloc(size, sizeof(*mmap_areas));
+		if (!mmap_areas) {
+			mmap_areas = old;
+			return -ENOMEM;
+		}
+		mmap_areas_size = size;
+		for (k = 0; k < old_size; ++k) {
+			unsigned int h;
+			if (!old[k].addr)
+				continue;
+			h = mmap_area_hash(old[k].addr);
+			while (mmap_areas[h].addr)
+				h = (h + 1) & (size - 1);
+			mmap_areas[h] = old[k];
+		}
+		free(old);
+	}
+	k = mmap_area_hash(addr);
+	while (mmap_areas[k].addr && mmap_areas[k].addr != addr)
+		k = (k + 1) & (mmap_areas_size - 1);
+	if (!mmap_areas[k].addr)
+		__atomic_add_fetch(&mmap_areas_count, 1, __ATOMIC_RELEASE);
+	mmap_areas[k].addr = addr;
+	mmap_areas[k].fd = fd;
+	return 0;
+}
+
+static void mmap_area_remove_slot(unsigned int k)
+{
+	unsigned int mask = mmap_areas_size - 1;
+	unsigned int j = k;
+
+	/* backward shift deletion keeps the probe sequences intact */
+	mmap_areas[k].addr = NULL;
+	__atomic_sub_fetch(&mmap_areas_count, 1, __ATOMIC_RELEASE);
+	for (;;) {
+		unsigned int h;
+		j = (j + 1) & mask;
+		if (!mmap_areas[j].addr)
+			return;
+		h = mmap_area_hash(mmap_areas[j].addr);
+		if (((j - h) & mask) < ((j - k) & mask))
+			continue;
+		mmap_areas[k] = mmap_areas[j];
+		mmap_areas[j].addr = NULL;
+		k = j;
+	}
+}
+
+/* stores the owning fd, returns -1 when addr is not an emulated area */
+static int mmap_area_remove(void *addr, int *fd)
+{
+	unsigned int k;
+
+	if (!mmap_areas_count)
+		return -1;
+	k = mmap_area_hash(addr);
+	while (mmap_areas[k].addr != addr) {
+		if (!mmap_areas[k].addr)
+			return -1;
+		k = (k + 1) & (mmap_areas_size - 1);
+	}
+	*fd = mmap_areas[k].fd;
+	mmap_area_remove_slot(k);
+	return 0;
+}
+
+/* the areas outlive the fd, until munmap() */
+static void mmap_area_close_fd(int fd)
+{
+	unsigned int k;
+
+	for (k = 0; mmap_areas_count && k < mmap_areas_size; k++)
+		if (mmap_areas[k].addr && mmap_areas[k].fd == fd)
+			mmap_areas[k].fd = -1;
 }
 
 static int is_dsp_device(const char *pathname)
@@ -145,8 +365,7 @@ static int oss_pcm_fcntl(int fd, int cmd, ...)
 	va_list args;
 	long arg;
 
-	if (!initialized)
-		initialize();
+	initialize();
 
 	va_start(args, cmd);
 	arg = va_arg(args, long);
@@ -154,7 +373,7 @@ static int oss_pcm_fcntl(int fd, int cmd, ...)
 
 	switch (cmd) {
 	case F_GETFL:
-		return fds[fd]->oflags;
+		return look_for_fd(fd)->oflags;
         case F_SETFL:
 		result = lib_oss_pcm_nonblock(fd, (arg & O_NONBLOCK) ? 1 : 0);
                 if (result < 0) {
@@ -185,7 +404,7 @@ static int oss_mixer_fcntl(int fd, int cmd, ...)
 
 	switch (cmd) {
 	case F_GETFL:
-		return fds[fd]->oflags;
+		return look_for_fd(fd)->oflags;
 	default:
 		DEBUG("mixer_fcntl(%d, ", fd);
 		result = _fcntl(fd, cmd, arg);
@@ -209,6 +428,18 @@ static ssize_t bad_read(int fd ATTRIBUTE_UNUSED, void *buf ATTRIBUTE_UNUSED, siz
 	return -1;
 }
 
+static ssize_t bad_writev(int fd ATTRIBUTE_UNUSED, const struct iovec *iov ATTRIBUTE_UNUSED, int iovcnt ATTRIBUTE_UNUSED)
+{
+	errno = EBADFD;
+	return -1;
+}
+
+static ssize_t bad_readv(int fd ATTRIBUTE_UNUSED, const struct iovec *iov ATTRIBUTE_UNUSED, int iovcnt ATTRIBUTE_UNUSED)
+{
+	errno = EBADFD;
+	return -1;
+}
+
 static void *bad_mmap(void *addr ATTRIBUTE_UNUSED, size_t len ATTRIBUTE_UNUSED,
 		      int prot ATTRIBUTE_UNUSED, int flags ATTRIBUTE_UNUSED,
 		      int fd ATTRIBUTE_UNUSED, off_t offset ATTRIBUTE_UNUSED)
@@ -228,6 +459,8 @@ static ops_t ops[FD_CLASSES] = {
 		.close = lib_oss_pcm_close,
 		.write = lib_oss_pcm_write,
 		.read = lib_oss_pcm_read,
+		.writev = lib_oss_pcm_writev,
+		.readv = lib_oss_pcm_readv,
 		.ioctl = lib_oss_pcm_ioctl,
 		.fcntl = oss_pcm_fcntl,
 		.mmap = lib_oss_pcm_mmap,
@@ -237,6 +470,8 @@ static ops_t ops[FD_CLASSES] = {
 		.close = lib_oss_mixer_close,
 		.write = bad_write,
 		.read = bad_read,
+		.writev = bad_writev,
+		.readv = bad_readv,
 		.ioctl = lib_oss_mixer_ioctl,
 		.fcntl = oss_mixer_fcntl,
 		.mmap = bad_mmap,
@@ -250,19 +485,25 @@ static int dsp_open_helper(const char *file, int oflag)
 	fd = lib_oss_pcm_open(file, oflag);
 	if (fd >= 0) {
 		int nfds;
-		fds[fd] = calloc(sizeof(fd_t), 1);
-		if (fds[fd] == NULL) {
+		fd_t *xfd = alloc_fd();
+		if (xfd == NULL) {
 			ops[FD_OSS_DSP].close(fd);
 			errno = ENOMEM;
 			return -1;
 		}
-		fds[fd]->class = FD_OSS_DSP;
-		fds[fd]->oflags = oflag;
+		xfd->class = FD_OSS_DSP;
+		xfd->oflags = oflag;
 		nfds = lib_oss_pcm_poll_fds(fd);
-		if (nfds > 0) {
-			fds[fd]->poll_fds = nfds;
-			poll_fds_add += nfds;
+		if (nfds > 0)
+			xfd->poll_fds = nfds;
+		if (fd_table_set(&fds, fd, xfd) < 0) {
+			release_fd(xfd);
+			ops[FD_OSS_DSP].close(fd);
+			errno = ENOMEM;
+			return -1;
 		}
+		__atomic_add_fetch(&poll_fds_add, xfd->poll_fds, __ATOMIC_RELAXED);
+		dsp_fds_mark(fd, 1);
 	}
 	return fd;
 }
@@ -272,14 +513,20 @@ static int mixer_open_helper(const char *file, int oflag)
 	int fd;
 	fd = lib_oss_mixer_open(file, oflag);
 	if (fd >= 0) {
-		fds[fd] = calloc(sizeof(fd_t), 1);
-		if (fds[fd] == NULL) {
+		fd_t *xfd = alloc_fd();
+		if (xfd == NULL) {
+			ops[FD_OSS_MIXER].close(fd);
+			errno = ENOMEM;
+			return -1;
+		}
+		xfd->class = FD_OSS_MIXER;
+		xfd->oflags = oflag;
+		if (fd_table_set(&fds, fd, xfd) < 0) {
+			release_fd(xfd);
 			ops[FD_OSS_MIXER].close(fd);
 			errno = ENOMEM;
 			return -1;
 		}
-		fds[fd]->class = FD_OSS_MIXER;
-		fds[fd]->oflags = oflag;
 	}
 	return fd;
 } 
@@ -290,8 +537,7 @@ int name(const char *file, int oflag, ...) \
 	va_list args; \
 	mode_t mode = 0; \
 	int fd; \
-	if (!initialized) \
-		initialize(); \
+	initialize(); \
 	if (oflag & O_CREAT) { \
 		va_start(args, oflag); \
 		mode = va_arg(args, mode_t); \
@@ -304,7 +550,7 @@ int name(const char *file, int oflag, ...) \
 	else { \
 		fd = callback(file, oflag, mode); \
 		if (fd >= 0) \
-			assert(fds[fd] == NULL); \
+			assert(!is_oss_device(fd)); \
 	} \
 	return fd; \
 }
@@ -314,22 +560,33 @@ DECL_OPEN(open64, _open64)
 
 int close(int fd)
 {
-	if (!initialized)
-		initialize();
+	fd_t *xfd;
 
-	if (! is_oss_device(fd)) {
+	initialize();
+
+	xfd = look_for_fd(fd);
+	if (! xfd) {
+		if (__atomic_load_n(&epoll_sets_count, __ATOMIC_RELAXED))
+			epoll_forget_set(fd);
 		return _close(fd);
 	} else {
-		fd_t *xfd = fds[fd];
 		int err;
 
-		fds[fd] = NULL;
-		poll_fds_add -= xfd->poll_fds;
-		if (poll_fds_add < 0) {
+		if (xfd->class == FD_OSS_DSP) {
+			dsp_fds_mark(fd, 0);
+			if (__atomic_load_n(&epoll_sets_count, __ATOMIC_RELAXED))
+				epoll_forget_dsp(fd);
+		}
+		fd_table_clear(&fds, fd);
+		pthread_mutex_lock(&mmap_areas_mutex);
+		mmap_area_close_fd(fd);
+		pthread_mutex_unlock(&mmap_areas_mutex);
+		if (__atomic_sub_fetch(&poll_fds_add, xfd->poll_fds, __ATOMIC_RELAXED) < 0) {
 			fprintf(stderr, "alsa-oss: poll_fds_add screwed up!\n");
-			poll_fds_add = 0;
+			__atomic_store_n(&poll_fds_add, 0, __ATOMIC_RELAXED);
 		}
 		err = ops[xfd->class].close(fd);
+		release_fd(xfd);
 		// assert(err >= 0);
 		return err;
 	}
@@ -337,90 +594,177 @@ int close(int fd)
 
 ssize_t write(int fd, const void *buf, size_t n)
 {
-	if (!initialized)
-		initialize();
+	fd_t *xfd;
+
+	initialize();
 
-	if (! is_oss_device(fd))
+	xfd = look_for_fd(fd);
+	if (! xfd)
 		return _write(fd, buf, n);
 	else
-		return ops[fds[fd]->class].write(fd, buf, n);
+		return ops[xfd->class].write(fd, buf, n);
 }
 
 ssize_t read(int fd, void *buf, size_t n)
 {
-	if (!initialized)
-		initialize();
+	fd_t *xfd;
 
-	if (! is_oss_device(fd))
+	initialize();
+
+	xfd = look_for_fd(fd);
+	if (! xfd)
 		return _read(fd, buf, n);
 	else
-		return ops[fds[fd]->class].read(fd, buf, n);
+		return ops[xfd->class].read(fd, buf, n);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	fd_t *xfd;
+
+	initialize();
+
+	xfd = look_for_fd(fd);
+	if (! xfd)
+		return _writev(fd, iov, iovcnt);
+	else
+		return ops[xfd->class].writev(fd, iov, iovcnt);
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	fd_t *xfd;
+
+	initialize();
+
+	xfd = look_for_fd(fd);
+	if (! xfd)
+		return _readv(fd, iov, iovcnt);
+	else
+		return ops[xfd->class].readv(fd, iov, iovcnt);
+}
+
+/* the OSS devices are not seekable */
+ssize_t pwrite(int fd, const void *buf, size_t n, off_t offset)
+{
+	initialize();
+
+	if (! look_for_fd(fd))
+		return _pwrite(fd, buf, n, offset);
+	errno = ESPIPE;
+	return -1;
+}
+
+ssize_t pread(int fd, void *buf, size_t n, off_t offset)
+{
+	initialize();
+
+	if (! look_for_fd(fd))
+		return _pread(fd, buf, n, offset);
+	errno = ESPIPE;
+	return -1;
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t n, off64_t offset)
+{
+	initialize();
+
+	if (! look_for_fd(fd))
+		return _pwrite64(fd, buf, n, offset);
+	errno = ESPIPE;
+	return -1;
+}
+
+ssize_t pread64(int fd, void *buf, size_t n, off64_t offset)
+{
+	initialize();
+
+	if (! look_for_fd(fd))
+		return _pread64(fd, buf, n, offset);
+	errno = ESPIPE;
+	return -1;
 }
 
 int ioctl(int fd, unsigned long request, ...)
 {
 	va_list args;
 	void *arg;
+	fd_t *xfd;
 
-	if (!initialized)
-		initialize();
+	initialize();
 
 	va_start(args, request);
 	arg = va_arg(args, void *);
 	va_end(args);
-	if (! is_oss_device(fd))
+	xfd = look_for_fd(fd);
+	if (! xfd)
 		return _ioctl(fd, request, arg);
 	else
-		return ops[fds[fd]->class].ioctl(fd, request, arg);
+		return ops[xfd->class].ioctl(fd, request, arg);
 }
 
 int fcntl(int fd, int cmd, ...)
 {
 	va_list args;
 	void *arg;
+	fd_t *xfd;
 
-	if (!initialized)
-		initialize();
+	initialize();
 
 	va_start(args, cmd);
 	arg = va_arg(args, void *);
 	va_end(args);
-	if (! is_oss_device(fd))
+	xfd = look_for_fd(fd);
+	if (! xfd)
 		return _fcntl(fd, cmd, arg);
 	else
-		return ops[fds[fd]->class].fcntl(fd, cmd, arg);
+		return ops[xfd->class].fcntl(fd, cmd, arg);
 }
 
 void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
 {
 	void *result;
+	fd_t *xfd;
 
-	if (!initialized)
-		initialize();
+	initialize();
 
-	if (! is_oss_device(fd))
+	xfd = look_for_fd(fd);
+	if (! xfd)
 		return _mmap(addr, len, prot, flags, fd, offset);
-	result = ops[fds[fd]->class].mmap(addr, len, prot, flags, fd, offset);
-	if (result != NULL && result != MAP_FAILED)
-		fds[fd]->mmap_area = result;
+	result = ops[xfd->class].mmap(addr, len, prot, flags, fd, offset);
+	if (result != NULL && result != MAP_FAILED) {
+		int err;
+		pthread_mutex_lock(&mmap_areas_mutex);
+		err = mmap_area_insert(result, fd);
+		pthread_mutex_unlock(&mmap_areas_mutex);
+		if (err < 0) {
+			ops[xfd->class].munmap(result, len);
+			errno = ENOMEM;
+			return MAP_FAILED;
+		}
+	}
 	return result;
 }
 
 int munmap(void *addr, size_t len)
 {
-	int fd;
+	fd_t *xfd;
+	int fd, err;
 
-	if (!initialized)
-		initialize();
+	initialize();
 
-	for (fd = 0; fd < open_max; ++fd) {
-		if (fds[fd] && fds[fd]->mmap_area == addr)
-			break;
-	}
-	if (fd >= open_max)
+	if (!__atomic_load_n(&mmap_areas_count, __ATOMIC_ACQUIRE))
 		return _munmap(addr, len);
-	fds[fd]->mmap_area = 0;
-	return ops[fds[fd]->class].munmap(addr, len);
+	pthread_mutex_lock(&mmap_areas_mutex);
+	err = mmap_area_remove(addr, &fd);
+	pthread_mutex_unlock(&mmap_areas_mutex);
+	if (err < 0)
+		return _munmap(addr, len);
+	/* closed since: the dsp side releases what it kept for the area */
+	xfd = fd < 0 ? NULL : look_for_fd(fd);
+	if (! xfd)
+		return ops[FD_OSS_DSP].munmap(addr, len);
+	return ops[xfd->class].munmap(addr, len);
 }
 
 #ifdef DEBUG_POLL
@@ -478,37 +822,151 @@ void dump_select(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
 }
 #endif
 
-static int poll_with_pcm(struct pollfd *pfds, unsigned long nfds, int timeout);
+/* how poll_with_pcm() waits: like poll() or like ppoll() */
+typedef struct {
+	int timeout;			/* ms, also shown by the debug dumps */
+	const struct timespec *tmo;
+	const sigset_t *sigmask;
+	int ppoll;
+} poll_wait_t;
 
-int poll(struct pollfd *pfds, unsigned long nfds, int timeout)
+static inline int poll_wait(struct pollfd *pfds, unsigned long nfds, const poll_wait_t *wait)
 {
-	unsigned int k;
+	if (wait->ppoll)
+		return _ppoll(pfds, nfds, wait->tmo, wait->sigmask);
+	return _poll(pfds, nfds, wait->timeout);
+}
 
-	if (!initialized)
-		initialize();
+static inline int timespec_to_ms(const struct timespec *tmo)
+{
+	if (!tmo)
+		return -1;
+	if (tmo->tv_sec >= INT_MAX / 1000)
+		return INT_MAX;
+	return tmo->tv_sec * 1000 + tmo->tv_nsec / 1000000;
+}
+
+static int poll_has_dsp(struct pollfd *pfds, unsigned long nfds)
+{
+	unsigned int k;
 
 	for (k = 0; k < nfds; ++k) {
-		int fd = pfds[k].fd;
-		if (! is_oss_device(fd))
-			continue;
-		if (fds[fd]->class == FD_OSS_DSP)
-			return poll_with_pcm(pfds, nfds, timeout);
+		if (is_oss_dsp_fd(pfds[k].fd))
+			return 1;
 	}
+	return 0;
+}
+
+static int poll_with_pcm(struct pollfd *pfds, unsigned long nfds, const poll_wait_t *wait);
+
+int poll(struct pollfd *pfds, unsigned long nfds, int timeout)
+{
+	poll_wait_t wait = { timeout, NULL, NULL, 0 };
+
+	initialize();
+
+	if (poll_has_dsp(pfds, nfds))
+		return poll_with_pcm(pfds, nfds, &wait);
 	return _poll(pfds, nfds, timeout);
 }
 
+int ppoll(struct pollfd *pfds, nfds_t nfds, const struct timespec *tmo,
+	  const sigset_t *sigmask)
+{
+	poll_wait_t wait = { timespec_to_ms(tmo), tmo, sigmask, 1 };
+
+	initialize();
+
+	if (poll_has_dsp(pfds, nfds))
+		return poll_with_pcm(pfds, nfds, &wait);
+	return _ppoll(pfds, nfds, tmo, sigmask);
+}
+
+
+/* where the descriptors of a caller's pollfd slot start in the translated set */
+typedef struct {
+	unsigned int index;
+	int oss;
+} poll_slot_t;
+
+/*
+ * Translation buffers of poll_with_pcm(), one per thread and kept between
+ * calls, so that no poll puts the whole set on the stack or the heap.
+ */
+typedef struct {
+	struct pollfd *pfds;
+	unsigned long pfds_alloc;
+	poll_slot_t *slots;
+	unsigned long slots_alloc;
+} poll_buffer_t;
+
+static __thread poll_buffer_t poll_buffer;
+static pthread_key_t poll_buffer_key;
+static pthread_once_t poll_buffer_once = PTHREAD_ONCE_INIT;
+
+static void poll_buffer_free(void *ptr)
+{
+	poll_buffer_t *buf = ptr;
+	free(buf->pfds);
+	free(buf->slots);
+	memset(buf, 0, sizeof(*buf));
+}
+
+static void poll_buffer_key_init(void)
+{
+	pthread_key_create(&poll_buffer_key, poll_buffer_free);
+}
+
+static poll_buffer_t *poll_buffer_get(unsigned long nfds, unsigned long nfds1)
+{
+	poll_buffer_t *buf = &poll_buffer;
+
+	if (!buf->slots) {
+		pthread_once(&poll_buffer_once, poll_buffer_key_init);
+		/* let the key destructor release the buffers at thread exit */
+		pthread_setspecific(poll_buffer_key, buf);
+	}
+	if (nfds1 > buf->pfds_alloc) {
+		struct pollfd *pfds = realloc(buf->pfds, nfds1 * sizeof(*pfds));
+		if (!pfds)
+			return NULL;
+		buf->pfds = pfds;
+		buf->pfds_alloc = nfds1;
+	}
+	if (nfds + 1 > buf->slots_alloc) {
+		poll_slot_t *slots = realloc(buf->slots, (nfds + 1) * sizeof(*slots));
+		if (!slots)
+			return NULL;
+		buf->slots = slots;
+		buf->slots_alloc = nfds + 1;
+	}
+	return buf;
+}
 
-static int poll_with_pcm(struct pollfd *pfds, unsigned long nfds, int timeout)
+static int poll_with_pcm(struct pollfd *pfds, unsigned long nfds, const poll_wait_t *wait)
 {
 	unsigned int k;
 	unsigned int nfds1;
 	int count;
-	struct pollfd pfds1[nfds + poll_fds_add + 16];
-
+	unsigned int nfds_add = __atomic_load_n(&poll_fds_add, __ATOMIC_RELAXED);
+	unsigned long max1 = nfds + nfds_add + 16;
+	poll_buffer_t *buf;
+	struct pollfd *pfds1;
+	poll_slot_t *slots;
+
+	buf = poll_buffer_get(nfds, max1);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+	pfds1 = buf->pfds;
+	slots = buf->slots;
 	nfds1 = 0;
 	for (k = 0; k < nfds; ++k) {
 		int fd = pfds[k].fd;
-		if (is_oss_device(fd) && fds[fd]->class == FD_OSS_DSP) {
+		slots[k].index = nfds1;
+		slots[k].oss = is_oss_dsp_fd(fd);
+		if (slots[k].oss) {
 			unsigned short events = pfds[k].events;
 			int fmode = 0;
 			if ((events & (POLLIN|POLLOUT)) == (POLLIN|POLLOUT))
@@ -525,30 +983,30 @@ static int poll_with_pcm(struct pollfd *pfds, unsigned long nfds, int timeout)
 			pfds1[nfds1] = pfds[k];
 			nfds1++;
 		}
-		if (nfds1 > nfds + poll_fds_add) {
+		if (nfds1 > max1 - 16) {
 			fprintf(stderr, "alsa-oss: Pollfd overflow!\n");
 			errno = EINVAL;
 			return -1;
 		}
 	}
+	slots[nfds].index = nfds1;
 #ifdef DEBUG_POLL
 	if (oss_wrapper_debug) {
 		fprintf(stderr, "Orig enter ");
-		dump_poll(pfds, nfds, timeout);
+		dump_poll(pfds, nfds, wait->timeout);
 		fprintf(stderr, "Changed enter ");
-		dump_poll(pfds1, nfds1, timeout);
+		dump_poll(pfds1, nfds1, wait->timeout);
 	}
 #endif
-	count = _poll(pfds1, nfds1, timeout);
+	count = poll_wait(pfds1, nfds1, wait);
 	if (count <= 0)
 		return count;
-	nfds1 = 0;
 	count = 0;
 	for (k = 0; k < nfds; ++k) {
-		int fd = pfds[k].fd;
+		struct pollfd *p = &pfds1[slots[k].index];
 		unsigned int revents;
-		if (is_oss_device(fd) && fds[fd]->class == FD_OSS_DSP) {
-			int result = lib_oss_pcm_poll_result(fd, &pfds1[nfds1]);
+		if (slots[k].oss) {
+			int result = lib_oss_pcm_poll_result(pfds[k].fd, p);
 			revents = 0;
 			if (result < 0) {
 				revents |= POLLNVAL;
@@ -557,10 +1015,8 @@ static int poll_with_pcm(struct pollfd *pfds, unsigned long nfds, int timeout)
 					   ((result & OSS_WAIT_EVENT_READ) ? POLLIN : 0) |
 					   ((result & OSS_WAIT_EVENT_WRITE) ? POLLOUT : 0);
 			}
-			nfds1 += lib_oss_pcm_poll_fds(fd);
 		} else {
-			revents = pfds1[nfds1].revents;
-			nfds1++;
+			revents = p->revents;
 		}
 		pfds[k].revents = revents;
 		if (revents)
@@ -569,44 +1025,110 @@ static int poll_with_pcm(struct pollfd *pfds, unsigned long nfds, int timeout)
 #ifdef DEBUG_POLL
 	if (oss_wrapper_debug) {
 		fprintf(stderr, "Changed exit ");
-		dump_poll(pfds1, nfds1, timeout);
+		dump_poll(pfds1, nfds1, wait->timeout);
 		fprintf(stderr, "Orig exit ");
-		dump_poll(pfds, nfds, timeout);
+		dump_poll(pfds, nfds, wait->timeout);
 	}
 #endif
 	return count;
 }
 
+/* fd_set is an array of longs on Linux, see FDS_WORD_BITS */
+#define FDS_WORD(set, k)	(((unsigned long *)(set))[k])
+
+/*
+ * Store in oss[] the emulated dsp fds present in any of the sets and return
+ * the count of words to scan, 0 when there are none.
+ */
+static int select_oss_fds(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
+			  unsigned long *oss)
+{
+	int k, words, last = 0;
+
+	if (nfds > FD_SETSIZE)
+		nfds = FD_SETSIZE;
+	words = FDS_WORDS(nfds);
+	for (k = 0; k < words; ++k) {
+		unsigned long dsp = __atomic_load_n(&dsp_fds_bits[k], __ATOMIC_ACQUIRE);
+		unsigned long any = 0;
+		if (!dsp) {
+			oss[k] = 0;
+			continue;
+		}
+		if (rfds)
+			any |= FDS_WORD(rfds, k);
+		if (wfds)
+			any |= FDS_WORD(wfds, k);
+		if (efds)
+			any |= FDS_WORD(efds, k);
+		/* bits beyond nfds are not part of the request */
+		if (k == words - 1 && nfds % FDS_WORD_BITS)
+			any &= (1UL << (nfds % FDS_WORD_BITS)) - 1;
+		oss[k] = dsp & any;
+		if (oss[k])
+			last = k + 1;
+	}
+	return last;
+}
+
+/* how select_with_pcm() waits: like select() or like pselect() */
+typedef struct {
+	struct timeval *timeout;	/* updated as the kernel does */
+	const struct timespec *tmo;
+	const sigset_t *sigmask;
+	int pselect;
+} select_wait_t;
+
+static inline int select_wait(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
+			      const select_wait_t *wait)
+{
+	if (wait->pselect)
+		return _pselect(nfds, rfds, wfds, efds, wait->tmo, wait->sigmask);
+	return _select(nfds, rfds, wfds, efds, wait->timeout);
+}
+
 static int select_with_pcm(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
-			   struct timeval *timeout);
+			   const select_wait_t *wait, unsigned long *oss, int words);
 
 int select(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
 	   struct timeval *timeout)
 {
-	int fd;
+	unsigned long oss[FDS_WORDS(FD_SETSIZE)];
+	int words;
 
-	if (!initialized)
-		initialize();
+	initialize();
 
-	for (fd = 0; fd < nfds; ++fd) {
-		int r = (rfds && FD_ISSET(fd, rfds));
-		int w = (wfds && FD_ISSET(fd, wfds));
-		int e = (efds && FD_ISSET(fd, efds));
-		if (!(r || w || e))
-			continue;
-		if (is_oss_device(fd) && fds[fd]->class == FD_OSS_DSP)
-			return select_with_pcm(nfds, rfds, wfds, efds, timeout);
+	words = select_oss_fds(nfds, rfds, wfds, efds, oss);
+	if (words) {
+		select_wait_t wait = { timeout, NULL, NULL, 0 };
+		return select_with_pcm(nfds, rfds, wfds, efds, &wait, oss, words);
 	}
 	return _select(nfds, rfds, wfds, efds, timeout);
 }
 
+int pselect(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
+	    const struct timespec *tmo, const sigset_t *sigmask)
+{
+	unsigned long oss[FDS_WORDS(FD_SETSIZE)];
+	int words;
+
+	initialize();
+
+	words = select_oss_fds(nfds, rfds, wfds, efds, oss);
+	if (words) {
+		select_wait_t wait = { NULL, tmo, sigmask, 1 };
+		return select_with_pcm(nfds, rfds, wfds, efds, &wait, oss, words);
+	}
+	return _pselect(nfds, rfds, wfds, efds, tmo, sigmask);
+}
+
 
 static int select_with_pcm(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
-			   struct timeval *timeout)
+			   const select_wait_t *wait, unsigned long *oss, int words)
 {
 	fd_set _rfds1, _wfds1, _efds1;
 	fd_set *rfds1, *wfds1, *efds1;
-	int fd;
+	int k, fd;
 	int nfds1 = nfds;
 	int count;
 
@@ -626,15 +1148,16 @@ static int select_with_pcm(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
 	} else {
 		efds1 = NULL;
 	}
-	for (fd = 0; fd < nfds; ++fd) {
-		int r = (rfds && FD_ISSET(fd, rfds));
-		int w = (wfds && FD_ISSET(fd, wfds));
-		int e = (efds && FD_ISSET(fd, efds));
-		if (!(r || w || e))
-			continue;
-		if (is_oss_device(fd) && fds[fd]->class == FD_OSS_DSP) {
-			int res, fmode = 0;
-			
+	for (k = 0; k < words; ++k) {
+		unsigned long bits = oss[k];
+		while (bits) {
+			int r, w, e, res, fmode = 0;
+
+			fd = k * FDS_WORD_BITS + __builtin_ctzl(bits);
+			bits &= bits - 1;
+			r = (rfds && FD_ISSET(fd, rfds));
+			w = (wfds && FD_ISSET(fd, wfds));
+			e = (efds && FD_ISSET(fd, efds));
 			if (r & w)
 				fmode = O_RDWR;
 			else if (r)
@@ -658,12 +1181,12 @@ static int select_with_pcm(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
 #ifdef DEBUG_SELECT
 	if (oss_wrapper_debug) {
 		fprintf(stderr, "Orig enter ");
-		dump_select(nfds, rfds, wfds, efds, timeout);
+		dump_select(nfds, rfds, wfds, efds, wait->timeout);
 		fprintf(stderr, "Changed enter ");
-		dump_select(nfds1, rfds1, wfds1, efds1, timeout);
+		dump_select(nfds1, rfds1, wfds1, efds1, wait->timeout);
 	}
 #endif
-	count = _select(nfds1, rfds1, wfds1, efds1, timeout);
+	count = select_wait(nfds1, rfds1, wfds1, efds1, wait);
 	if (count < 0)
 		return count;
 	if (count == 0) {
@@ -675,70 +1198,741 @@ static int select_with_pcm(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
 			FD_ZERO(efds);
 		return 0;
 	}
+	/* plain fds: keep what the kernel reported, word by word */
 	count = 0;
-	for (fd = 0; fd < nfds; ++fd) {
-		int r = (rfds && FD_ISSET(fd, rfds));
-		int w = (wfds && FD_ISSET(fd, wfds));
-		int e = (efds && FD_ISSET(fd, efds));
-		int r1, w1, e1;
-		if (!(r || w || e))
-			continue;
-		if (is_oss_device(fd) && fds[fd]->class == FD_OSS_DSP) {
-			int result = lib_oss_pcm_select_result(fd, rfds1, wfds1, efds1);
+	if (nfds > FD_SETSIZE)
+		nfds = FD_SETSIZE;
+	for (k = 0; k < (int)FDS_WORDS(nfds); ++k) {
+		unsigned long mask = ~0UL;
+		unsigned long r = 0, w = 0, e = 0;
+		if (k == (int)FDS_WORDS(nfds) - 1 && nfds % FDS_WORD_BITS)
+			mask = (1UL << (nfds % FDS_WORD_BITS)) - 1;
+		if (k < words)
+			mask &= ~oss[k];
+		if (rfds) {
+			r = FDS_WORD(rfds, k) & FDS_WORD(rfds1, k) & mask;
+			FDS_WORD(rfds, k) = (FDS_WORD(rfds, k) & ~mask) | r;
+		}
+		if (wfds) {
+			w = FDS_WORD(wfds, k) & FDS_WORD(wfds1, k) & mask;
+			FDS_WORD(wfds, k) = (FDS_WORD(wfds, k) & ~mask) | w;
+		}
+		if (efds) {
+			e = FDS_WORD(efds, k) & FDS_WORD(efds1, k) & mask;
+			FDS_WORD(efds, k) = (FDS_WORD(efds, k) & ~mask) | e;
+		}
+		count += __builtin_popcountl(r | w | e);
+	}
+	for (k = 0; k < words; ++k) {
+		unsigned long bits = oss[k];
+		while (bits) {
+			int r, w, e, r1, w1, e1, result;
+
+			fd = k * FDS_WORD_BITS + __builtin_ctzl(bits);
+			bits &= bits - 1;
+			r = (rfds && FD_ISSET(fd, rfds));
+			w = (wfds && FD_ISSET(fd, wfds));
+			e = (efds && FD_ISSET(fd, efds));
+			result = lib_oss_pcm_select_result(fd, rfds1, wfds1, efds1);
 			r1 = w1 = e1 = 0;
 			if (result < 0 && e) {
-				if (efds)
-					FD_SET(fd, efds);
 				e1 = 1;
-			} else {
-				if (result & OSS_WAIT_EVENT_ERROR) {
-					if (efds)
-						FD_SET(fd, efds);
+			} else if (result >= 0) {
+				if (result & OSS_WAIT_EVENT_ERROR)
 					e1 = 1;
-				}
-				if (result & OSS_WAIT_EVENT_READ) {
-					if (rfds)
-						FD_SET(fd, rfds);
+				if (result & OSS_WAIT_EVENT_READ)
 					r1 = 1;
-				}
-				if (result & OSS_WAIT_EVENT_WRITE) {
-					if (wfds)
-						FD_SET(fd, wfds);
+				if (result & OSS_WAIT_EVENT_WRITE)
 					w1 = 1;
-				}
 			}
-		} else {
-			r1 = (r && FD_ISSET(fd, rfds1));
-			w1 = (w && FD_ISSET(fd, wfds1));
-			e1 = (e && FD_ISSET(fd, efds1));
-		}
-		if (r && !r1 && rfds)
-			FD_CLR(fd, rfds);
-		if (w && !w1 && wfds)
-			FD_CLR(fd, wfds);
-		if (e && !e1 && efds)
-			FD_CLR(fd, efds);
-		if (r1 || w1 || e1)
-			count++;
+			if (rfds) {
+				if (r1)
+					FD_SET(fd, rfds);
+				else if (r)
+					FD_CLR(fd, rfds);
+			}
+			if (wfds) {
+				if (w1)
+					FD_SET(fd, wfds);
+				else if (w)
+					FD_CLR(fd, wfds);
+			}
+			if (efds) {
+				if (e1)
+					FD_SET(fd, efds);
+				else if (e)
+					FD_CLR(fd, efds);
+			}
+			if (r1 || w1 || e1)
+				count++;
+		}
 	}
 #ifdef DEBUG_SELECT
 	if (oss_wrapper_debug) {
 		fprintf(stderr, "Changed exit ");
-		dump_select(nfds1, rfds1, wfds1, efds1, timeout);
+		dump_select(nfds1, rfds1, wfds1, efds1, wait->timeout);
 		fprintf(stderr, "Orig exit ");
-		dump_select(nfds, rfds, wfds, efds, timeout);
+		dump_select(nfds, rfds, wfds, efds, wait->timeout);
 	}
 #endif
 	return count;
 }
 
 
+/*
+ * Entry points of programs built with _FORTIFY_SOURCE.
+ */
+extern void __chk_fail(void) __attribute__ ((__noreturn__));
+
+int __poll_chk(struct pollfd *pfds, nfds_t nfds, int timeout, size_t fdslen)
+{
+	if (fdslen / sizeof(*pfds) < nfds)
+		__chk_fail();
+	return poll(pfds, nfds, timeout);
+}
+
+int __ppoll_chk(struct pollfd *pfds, nfds_t nfds, const struct timespec *tmo,
+		const sigset_t *sigmask, size_t fdslen)
+{
+	if (fdslen / sizeof(*pfds) < nfds)
+		__chk_fail();
+	return ppoll(pfds, nfds, tmo, sigmask);
+}
+
+#if TIME64_WRAPPERS
+/*
+ * Programs built with _TIME_BITS=64 on 32bit targets call these instead.
+ * The timeouts are relative, so they are simply narrowed for the
+ * emulation path.
+ */
+static void oss_timespec64_to_timespec(const struct oss_timespec64 *t64, struct timespec *t)
+{
+	t->tv_sec = t64->tv_sec > LONG_MAX ? LONG_MAX : t64->tv_sec;
+	t->tv_nsec = t64->tv_nsec;
+}
+
+int __ppoll64(struct pollfd *pfds, nfds_t nfds, const struct oss_timespec64 *tmo,
+	      const sigset_t *sigmask)
+{
+	struct timespec ts;
+
+	initialize();
+
+	if (!poll_has_dsp(pfds, nfds))
+		return _ppoll64(pfds, nfds, tmo, sigmask);
+	if (tmo)
+		oss_timespec64_to_timespec(tmo, &ts);
+	return ppoll(pfds, nfds, tmo ? &ts : NULL, sigmask);
+}
+
+int __ppoll64_chk(struct pollfd *pfds, nfds_t nfds, const struct oss_timespec64 *tmo,
+		  const sigset_t *sigmask, size_t fdslen)
+{
+	if (fdslen / sizeof(*pfds) < nfds)
+		__chk_fail();
+	return __ppoll64(pfds, nfds, tmo, sigmask);
+}
+
+int __pselect64(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
+		const struct oss_timespec64 *tmo, const sigset_t *sigmask)
+{
+	unsigned long oss[FDS_WORDS(FD_SETSIZE)];
+	struct timespec ts;
+
+	initialize();
+
+	if (!select_oss_fds(nfds, rfds, wfds, efds, oss))
+		return _pselect64(nfds, rfds, wfds, efds, tmo, sigmask);
+	if (tmo)
+		oss_timespec64_to_timespec(tmo, &ts);
+	return pselect(nfds, rfds, wfds, efds, tmo ? &ts : NULL, sigmask);
+}
+
+int __select64(int nfds, fd_set *rfds, fd_set *wfds, fd_set *efds,
+	       struct oss_timeval64 *timeout)
+{
+	unsigned long oss[FDS_WORDS(FD_SETSIZE)];
+	struct timeval tv;
+	int result;
+
+	initialize();
+
+	if (!select_oss_fds(nfds, rfds, wfds, efds, oss))
+		return _select64(nfds, rfds, wfds, efds, timeout);
+	if (timeout) {
+		tv.tv_sec = timeout->tv_sec > LONG_MAX ? LONG_MAX : timeout->tv_sec;
+		tv.tv_usec = timeout->tv_usec;
+	}
+	result = select(nfds, rfds, wfds, efds, timeout ? &tv : NULL);
+	/* report the time left like select() does */
+	if (timeout) {
+		timeout->tv_sec = tv.tv_sec;
+		timeout->tv_usec = tv.tv_usec;
+	}
+	return result;
+}
+#endif /* TIME64_WRAPPERS */
+
+/*
+ * epoll support.  The fd of an emulated dsp is a placeholder which is
+ * always ready, so epoll_ctl() registers the ALSA poll descriptors of the
+ * dsp in its place.  Each of them carries a pointer to its slot below as
+ * event data, which epoll_wait() recognizes and folds back into a single
+ * event with the caller's data, translated by lib_oss_pcm_poll_result().
+ *
+ * Another thread may already hold events for the descriptors of an entry
+ * deleted or replaced since.  Such entries are retired rather than freed
+ * while a wait is in flight on the set, so that their events are still
+ * recognized, and dropped instead of reaching the application.
+ */
+typedef struct epoll_dsp epoll_dsp_t;
+
+typedef struct {
+	epoll_dsp_t *owner;
+	struct pollfd pfd;
+} epoll_dsp_slot_t;
+
+struct epoll_dsp {
+	int fd;
+	struct epoll_event event;	/* as given by the caller */
+	int fired;
+	int count;
+	int alloc;			/* slots allocated */
+	int retired;
+	epoll_dsp_t *next;
+	epoll_dsp_slot_t slots[0];
+};
+
+typedef struct epoll_set {
+	int epfd;
+	unsigned int waiters;		/* waits in flight */
+	epoll_dsp_t *dsps;
+	epoll_dsp_t *retired;		/* freed when no wait is in flight */
+	struct epoll_set *next;
+} epoll_set_t;
+
+/* epoll_sets_count is the count of sets holding a dsp or a wait */
+static epoll_set_t *epoll_sets;
+static pthread_mutex_t epoll_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define EPOLL_CTL_FLAGS	(EPOLLET | EPOLLONESHOT)
+
+/* epoll_*() helpers are called with epoll_mutex held */
+static epoll_set_t *epoll_find_set(int epfd, int create)
+{
+	epoll_set_t *set;
+
+	for (set = epoll_sets; set; set = set->next)
+		if (set->epfd == epfd)
+			return set;
+	if (!create)
+		return NULL;
+	set = calloc(1, sizeof(*set));
+	if (!set)
+		return NULL;
+	set->epfd = epfd;
+	set->next = epoll_sets;
+	epoll_sets = set;
+	__atomic_add_fetch(&epoll_sets_count, 1, __ATOMIC_RELAXED);
+	return set;
+}
+
+static void epoll_retire_dsp(epoll_set_t *set, epoll_dsp_t *d)
+{
+	d->retired = 1;
+	if (!set->waiters) {
+		free(d);
+		return;
+	}
+	d->next = set->retired;
+	set->retired = d;
+}
+
+static void epoll_free_retired(epoll_set_t *set)
+{
+	while (set->retired) {
+		epoll_dsp_t *d = set->retired;
+		set->retired = d->next;
+		free(d);
+	}
+}
+
+/* the set itself stays until its last wait is over */
+static void epoll_free_set(epoll_set_t *set)
+{
+	epoll_set_t **p;
+
+	while (set->dsps) {
+		epoll_dsp_t *d = set->dsps;
+		set->dsps = d->next;
+		epoll_retire_dsp(set, d);
+	}
+	if (set->waiters)
+		return;
+	epoll_free_retired(set);
+	for (p = &epoll_sets; *p; p = &(*p)->next) {
+		if (*p == set) {
+			*p = set->next;
+			break;
+		}
+	}
+	free(set);
+	__atomic_sub_fetch(&epoll_sets_count, 1, __ATOMIC_RELAXED);
+}
+
+static epoll_dsp_t **epoll_find_dsp(epoll_set_t *set, int fd)
+{
+	epoll_dsp_t **p;
+
+	for (p = &set->dsps; *p; p = &(*p)->next)
+		if ((*p)->fd == fd)
+			return p;
+	return NULL;
+}
+
+static epoll_dsp_slot_t *epoll_find_slot(epoll_dsp_t *d, void *ptr)
+{
+	for (; d; d = d->next) {
+		if ((epoll_dsp_slot_t *)ptr >= d->slots &&
+		    (epoll_dsp_slot_t *)ptr < d->slots + d->count)
+			return ptr;
+	}
+	return NULL;
+}
+
+static void epoll_del_dsp(epoll_set_t *set, epoll_dsp_t **p)
+{
+	epoll_dsp_t *d = *p;
+	int k;
+
+	for (k = 0; k < d->count; ++k)
+		_epoll_ctl(set->epfd, EPOLL_CTL_DEL, d->slots[k].pfd.fd, NULL);
+	*p = d->next;
+	epoll_retire_dsp(set, d);
+	if (!set->dsps)
+		epoll_free_set(set);
+}
+
+/*
+ * The current ALSA descriptors of a dsp, in the poll buffer of the
+ * thread.  Takes the dsp mutex, so it is called without epoll_mutex
+ * from the waits.
+ */
+static int epoll_prepare(int fd, struct epoll_event *event, struct pollfd **pfds)
+{
+	poll_buffer_t *buf;
+	int count, fmode;
+
+	count = lib_oss_pcm_poll_fds(fd);
+	if (count < 0)
+		return -errno;
+	buf = poll_buffer_get(0, count + 1);
+	if (!buf)
+		return -ENOMEM;
+	if ((event->events & (EPOLLIN|EPOLLOUT)) == (EPOLLIN|EPOLLOUT))
+		fmode = O_RDWR;
+	else if (event->events & EPOLLIN)
+		fmode = O_RDONLY;
+	else
+		fmode = O_WRONLY;
+	count = lib_oss_pcm_poll_prepare(fd, fmode, buf->pfds);
+	if (count < 0)
+		return -errno;
+	*pfds = buf->pfds;
+	return count;
+}
+
+/* a dsp entry holding its current ALSA descriptors, not registered yet */
+static int epoll_new_dsp(int fd, struct epoll_event *event, epoll_dsp_t **dp)
+{
+	epoll_dsp_t *d;
+	struct pollfd *pfds;
+	int k, count;
+
+	count = epoll_prepare(fd, event, &pfds);
+	if (count < 0)
+		return count;
+	d = calloc(1, sizeof(*d) + count * sizeof(d->slots[0]));
+	if (!d)
+		return -ENOMEM;
+	for (k = 0; k < count; ++k) {
+		d->slots[k].owner = d;
+		d->slots[k].pfd = pfds[k];
+	}
+	d->fd = fd;
+	d->event = *event;
+	d->count = count;
+	d->alloc = count;
+	*dp = d;
+	return 0;
+}
+
+static int epoll_register_dsp(epoll_set_t *set, epoll_dsp_t *d)
+{
+	int k;
+
+	for (k = 0; k < d->count; ++k) {
+		struct epoll_event ev;
+		ev.events = d->slots[k].pfd.events | (d->event.events & EPOLL_CTL_FLAGS);
+		ev.data.ptr = &d->slots[k];
+		if (_epoll_ctl(set->epfd, EPOLL_CTL_ADD, d->slots[k].pfd.fd, &ev) < 0) {
+			int err = -errno;
+			while (--k >= 0)
+				_epoll_ctl(set->epfd, EPOLL_CTL_DEL, d->slots[k].pfd.fd, NULL);
+			return err;
+		}
+	}
+	return 0;
+}
+
+static int epoll_add_dsp(epoll_set_t *set, int fd, struct epoll_event *event)
+{
+	epoll_dsp_t *d;
+	int err;
+
+	err = epoll_new_dsp(fd, event, &d);
+	if (err < 0)
+		return err;
+	err = epoll_register_dsp(set, d);
+	if (err < 0) {
+		free(d);
+		return err;
+	}
+	d->next = set->dsps;
+	set->dsps = d;
+	return 0;
+}
+
+static int epoll_same_slots(epoll_dsp_t *d, struct pollfd *pfds, int count)
+{
+	int k;
+
+	if (d->count != count)
+		return 0;
+	for (k = 0; k < count; ++k)
+		if (d->slots[k].pfd.fd != pfds[k].fd ||
+		    d->slots[k].pfd.events != pfds[k].events)
+			return 0;
+	return 1;
+}
+
+/*
+ * Registers new descriptors for an entry.  They are written in place
+ * unless they do not fit or another wait may hold events of the old
+ * ones, then the entry is replaced and retired.  One left without any
+ * descriptor on error is tried again by the next wait.
+ */
+static int epoll_update_dsp(epoll_set_t *set, epoll_dsp_t **dp,
+			    struct pollfd *pfds, int count)
+{
+	epoll_dsp_t *d = *dp, *n = d;
+	int k, err;
+
+	if (count > d->alloc || set->waiters > 1) {
+		int alloc = count > d->alloc ? count : d->alloc;
+		n = calloc(1, sizeof(*n) + alloc * sizeof(n->slots[0]));
+		if (!n)
+			return -ENOMEM;
+		n->fd = d->fd;
+		n->event = d->event;
+		n->alloc = alloc;
+	}
+	for (k = 0; k < d->count; ++k)
+		_epoll_ctl(set->epfd, EPOLL_CTL_DEL, d->slots[k].pfd.fd, NULL);
+	if (n != d) {
+		epoll_dsp_t **p = epoll_find_dsp(set, d->fd);
+		n->next = d->next;
+		*p = n;
+		epoll_retire_dsp(set, d);
+	}
+	for (k = 0; k < count; ++k) {
+		n->slots[k].owner = n;
+		n->slots[k].pfd = pfds[k];
+	}
+	n->count = count;
+	err = epoll_register_dsp(set, n);
+	if (err < 0)
+		n->count = 0;
+	*dp = n;
+	return err;
+}
+
+/* ends a wait counted by epoll_refresh() */
+static void epoll_wait_end(epoll_set_t *set)
+{
+	if (--set->waiters)
+		return;
+	epoll_free_retired(set);
+	if (!set->dsps)
+		epoll_free_set(set);
+}
+
+/*
+ * The descriptors of a dsp, their events and the mmap avail_min follow
+ * its setup, which may have changed since epoll_ctl(), e.g. a stream
+ * reconfigured by SETFMT or mapped afterwards.  poll_prepare is run
+ * again before each wait, into the poll buffer of the thread and with
+ * epoll_mutex released, and only what changed is registered again.
+ * The wait is counted in flight first, which keeps every entry seen
+ * here allocated, until epoll_translate().
+ */
+static int epoll_refresh(int epfd, epoll_set_t **setp)
+{
+	epoll_set_t *set;
+	epoll_dsp_t *d;
+	int err = 0;
+
+	pthread_mutex_lock(&epoll_mutex);
+	set = epoll_find_set(epfd, 0);
+	*setp = set;
+	if (!set) {
+		pthread_mutex_unlock(&epoll_mutex);
+		return 0;
+	}
+	set->waiters++;
+	d = set->dsps;
+	while (d) {
+		struct epoll_event event = d->event;
+		struct pollfd *pfds;
+		int fd = d->fd, count;
+
+		pthread_mutex_unlock(&epoll_mutex);
+		count = epoll_prepare(fd, &event, &pfds);
+		pthread_mutex_lock(&epoll_mutex);
+		if (d->retired) {
+			/* deleted or replaced meanwhile */
+			d = set->dsps;
+			continue;
+		}
+		/* a dsp being closed is dropped by epoll_forget_dsp() */
+		if (count >= 0 && !epoll_same_slots(d, pfds, count)) {
+			err = epoll_update_dsp(set, &d, pfds, count);
+			if (err < 0)
+				break;
+		}
+		d = d->next;
+	}
+	if (err < 0) {
+		epoll_wait_end(set);
+		*setp = NULL;
+	}
+	pthread_mutex_unlock(&epoll_mutex);
+	return err;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+	epoll_set_t *set;
+	epoll_dsp_t **p;
+	int err = 0;
+
+	initialize();
+
+	if (!is_oss_dsp_fd(fd))
+		return _epoll_ctl(epfd, op, fd, event);
+	pthread_mutex_lock(&epoll_mutex);
+	set = epoll_find_set(epfd, op == EPOLL_CTL_ADD);
+	p = set ? epoll_find_dsp(set, fd) : NULL;
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		if (!set)
+			err = -ENOMEM;
+		else if (p)
+			err = -EEXIST;
+		else
+			err = epoll_add_dsp(set, fd, event);
+		if (set && !set->dsps)
+			epoll_free_set(set);
+		break;
+	case EPOLL_CTL_MOD:
+		if (!p) {
+			err = -ENOENT;
+			break;
+		}
+		/* the streams to watch may change, register them again */
+		epoll_del_dsp(set, p);
+		set = epoll_find_set(epfd, 1);
+		if (!set) {
+			err = -ENOMEM;
+			break;
+		}
+		err = epoll_add_dsp(set, fd, event);
+		if (!set->dsps)
+			epoll_free_set(set);
+		break;
+	case EPOLL_CTL_DEL:
+		if (!p)
+			err = -ENOENT;
+		else
+			epoll_del_dsp(set, p);
+		break;
+	default:
+		err = -EINVAL;
+		break;
+	}
+	pthread_mutex_unlock(&epoll_mutex);
+	DEBUG("epoll_ctl(%d, %d, %d) -> %d\n", epfd, op, fd, err);
+	if (err < 0) {
+		errno = -err;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Fold the events of the ALSA descriptors into the dsp ones, in place,
+ * and end the wait epoll_refresh() counted.
+ */
+static int epoll_translate(epoll_set_t *set, struct epoll_event *events, int count)
+{
+	epoll_dsp_t *d;
+	int k, out = 0, err = errno;
+
+	if (!set)
+		return count;
+	pthread_mutex_lock(&epoll_mutex);
+	if (count <= 0) {
+		out = count;
+		goto _end;
+	}
+	for (d = set->dsps; d; d = d->next) {
+		d->fired = 0;
+		for (k = 0; k < d->count; ++k)
+			d->slots[k].pfd.revents = 0;
+	}
+	for (k = 0; k < count; ++k) {
+		epoll_dsp_slot_t *slot = epoll_find_slot(set->dsps, events[k].data.ptr);
+		if (!slot) {
+			if (!epoll_find_slot(set->retired, events[k].data.ptr))
+				events[out++] = events[k];
+			continue;
+		}
+		slot->pfd.revents = events[k].events;
+		slot->owner->fired = 1;
+	}
+	for (d = set->dsps; d; d = d->next) {
+		struct pollfd pfds[d->count + 1];
+		unsigned int revents = 0;
+		int result;
+		if (!d->fired)
+			continue;
+		for (k = 0; k < d->count; ++k)
+			pfds[k] = d->slots[k].pfd;
+		result = lib_oss_pcm_poll_result(d->fd, pfds);
+		if (result < 0) {
+			revents = EPOLLERR;
+		} else {
+			revents = ((result & OSS_WAIT_EVENT_ERROR) ? EPOLLERR : 0) |
+				  ((result & OSS_WAIT_EVENT_READ) ? EPOLLIN : 0) |
+				  ((result & OSS_WAIT_EVENT_WRITE) ? EPOLLOUT : 0);
+		}
+		revents &= d->event.events | EPOLLERR;
+		if (!revents)
+			continue;
+		/* never more dsps than the events they came from */
+		events[out].events = revents;
+		events[out].data = d->event.data;
+		out++;
+	}
+ _end:
+	epoll_wait_end(set);
+	pthread_mutex_unlock(&epoll_mutex);
+	errno = err;
+	return out;
+}
+
+static int epoll_wait_with_pcm(int epfd, struct epoll_event *events, int maxevents,
+			       int timeout, const sigset_t *sigmask)
+{
+	struct timespec end, now;
+	epoll_set_t *set;
+	int n, count;
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		end.tv_sec += timeout / 1000;
+		end.tv_nsec += (timeout % 1000) * 1000000L;
+		if (end.tv_nsec >= 1000000000L) {
+			end.tv_sec++;
+			end.tv_nsec -= 1000000000L;
+		}
+	}
+	for (;;) {
+		count = epoll_refresh(epfd, &set);
+		if (count < 0) {
+			errno = -count;
+			return -1;
+		}
+		if (sigmask)
+			n = _epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+		else
+			n = _epoll_wait(epfd, events, maxevents, timeout);
+		count = epoll_translate(set, events, n);
+		if (n <= 0 || count > 0 || timeout == 0)
+			return count;
+		/* only dsp wakeups which ALSA does not consider ready, wait again */
+		if (timeout > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			timeout = (end.tv_sec - now.tv_sec) * 1000 +
+				  (end.tv_nsec - now.tv_nsec) / 1000000L;
+			if (timeout <= 0)
+				return 0;
+		}
+	}
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	initialize();
+
+	if (!__atomic_load_n(&epoll_sets_count, __ATOMIC_RELAXED))
+		return _epoll_wait(epfd, events, maxevents, timeout);
+	return epoll_wait_with_pcm(epfd, events, maxevents, timeout, NULL);
+}
+
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout,
+		const sigset_t *sigmask)
+{
+	initialize();
+
+	if (!__atomic_load_n(&epoll_sets_count, __ATOMIC_RELAXED))
+		return _epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+	return epoll_wait_with_pcm(epfd, events, maxevents, timeout, sigmask);
+}
+
+/* the epoll fd itself is being closed */
+static void epoll_forget_set(int epfd)
+{
+	epoll_set_t *set;
+
+	pthread_mutex_lock(&epoll_mutex);
+	set = epoll_find_set(epfd, 0);
+	if (set)
+		epoll_free_set(set);
+	pthread_mutex_unlock(&epoll_mutex);
+}
+
+/* a dsp is being closed, drop it from every set */
+static void epoll_forget_dsp(int fd)
+{
+	epoll_set_t *set, *next;
+
+	pthread_mutex_lock(&epoll_mutex);
+	for (set = epoll_sets; set; set = next) {
+		epoll_dsp_t **p = epoll_find_dsp(set, fd);
+		next = set->next;
+		if (p)
+			epoll_del_dsp(set, p);
+	}
+	pthread_mutex_unlock(&epoll_mutex);
+}
+
+
 #include "stdioemu.c"
 
 FILE *fopen(const char* path, const char *mode)
 {
-	if (!initialized)
-		initialize();
+	initialize();
 
 	if (!is_dsp_device(path)) 
 		return _fopen(path, mode);
@@ -748,8 +1942,7 @@ FILE *fopen(const char* path, const char *mode)
 
 FILE *fopen64(const char* path, const char *mode)
 {
-	if (!initialized)   
-		initialize(); 
+	initialize();
 
 	if (!is_dsp_device(path))
 		return _fopen64(path, mode);
@@ -796,6 +1989,12 @@ strong_alias(open64, __open64);
 strong_alias(close, __close);
 strong_alias(write, __write);
 strong_alias(read, __read);
+strong_alias(writev, __writev);
+strong_alias(readv, __readv);
+strong_alias(pwrite, __pwrite);
+strong_alias(pread, __pread);
+strong_alias(pwrite64, __pwrite64);
+strong_alias(pread64, __pread64);
 strong_alias(ioctl, __ioctl);
 strong_alias(fcntl, __fcntl);
 strong_alias(mmap, __mmap);
@@ -805,8 +2004,7 @@ strong_alias(select, __select);
 strong_alias(fopen, __fopen);
 strong_alias(fopen64, __fopen64);
 
-/* called by each override if needed */
-static void initialize()
+static void do_initialize(void)
 {
 	char *s = getenv("ALSA_OSS_DEBUG");
 	if (s)
@@ -814,21 +2012,39 @@ static void initialize()
 	open_max = sysconf(_SC_OPEN_MAX);
 	if (open_max < 0)
 		exit(1);
-	fds = calloc(open_max, sizeof(*fds));
-	if (!fds)
-		exit(1);
 	_open = dlsym(RTLD_NEXT, "open");
 	_open64 = dlsym(RTLD_NEXT, "open64");
 	_close = dlsym(RTLD_NEXT, "close");
 	_write = dlsym(RTLD_NEXT, "write");
 	_read = dlsym(RTLD_NEXT, "read");
+	_writev = dlsym(RTLD_NEXT, "writev");
+	_readv = dlsym(RTLD_NEXT, "readv");
+	_pwrite = dlsym(RTLD_NEXT, "pwrite");
+	_pread = dlsym(RTLD_NEXT, "pread");
+	_pwrite64 = dlsym(RTLD_NEXT, "pwrite64");
+	_pread64 = dlsym(RTLD_NEXT, "pread64");
 	_ioctl = dlsym(RTLD_NEXT, "ioctl");
 	_fcntl = dlsym(RTLD_NEXT, "fcntl");
 	_mmap = dlsym(RTLD_NEXT, "mmap");
 	_munmap = dlsym(RTLD_NEXT, "munmap");
 	_select = dlsym(RTLD_NEXT, "select");
 	_poll = dlsym(RTLD_NEXT, "poll");
+	_ppoll = dlsym(RTLD_NEXT, "ppoll");
+	_pselect = dlsym(RTLD_NEXT, "pselect");
+#if TIME64_WRAPPERS
+	_ppoll64 = dlsym(RTLD_NEXT, "__ppoll64");
+	_pselect64 = dlsym(RTLD_NEXT, "__pselect64");
+	_select64 = dlsym(RTLD_NEXT, "__select64");
+#endif
+	_epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+	_epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+	_epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
 	_fopen = dlsym(RTLD_NEXT, "fopen");
 	_fopen64 = dlsym(RTLD_NEXT, "fopen64");
-	initialized = 1;
+}
+
+/* called by each override */
+static void initialize(void)
+{
+	pthread_once(&initialize_once, do_initialize);
 }
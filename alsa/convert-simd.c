@@ -0,0 +1,368 @@
+/*
+ *  OSS -> ALSA compatibility layer
+ *  Vectorized sample format conversion kernels
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The x86 kernels are built with target attributes, so the library runs
+ * on any CPU and alsa_oss_convert_kernel_sets() only offers what cpuid
+ * reports.  NEON is part of the aarch64 baseline.  Tails shorter than a
+ * vector go to the scalar kernels, which also keep the results identical.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "convert.h"
+
+#define TAIL(kernel, done, dbytes, sbytes) \
+	alsa_oss_convert_scalar.kernel((uint8_t *)dst + (done) * (dbytes), \
+				       (const uint8_t *)src + (done) * (sbytes), \
+				       samples - (done))
+
+#ifdef ALSA_OSS_CONVERT_X86
+#include <immintrin.h>
+
+#define SSE2	__attribute__ ((__target__("sse2")))
+#define AVX2	__attribute__ ((__target__("avx2")))
+
+static SSE2 void sse2_s16_swap(void *dst, const void *src, size_t samples)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)((const int16_t *)src + k));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)((int16_t *)dst + k), v);
+	}
+	TAIL(s16_swap, k, 2, 2);
+}
+
+static SSE2 void sse2_u8_to_s16(void *dst, const void *src, size_t samples)
+{
+	const __m128i sign = _mm_set1_epi8((char)0x80);
+	const __m128i zero = _mm_setzero_si128();
+	size_t k;
+
+	for (k = 0; k + 16 <= samples; k += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)((const uint8_t *)src + k));
+		v = _mm_xor_si128(v, sign);
+		_mm_storeu_si128((__m128i *)((int16_t *)dst + k), _mm_unpacklo_epi8(zero, v));
+		_mm_storeu_si128((__m128i *)((int16_t *)dst + k + 8), _mm_unpackhi_epi8(zero, v));
+	}
+	TAIL(u8_to_s16, k, 2, 1);
+}
+
+static SSE2 void sse2_s16_to_u8(void *dst, const void *src, size_t samples)
+{
+	const __m128i sign = _mm_set1_epi8((char)0x80);
+	size_t k;
+
+	for (k = 0; k + 16 <= samples; k += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)((const int16_t *)src + k));
+		__m128i b = _mm_loadu_si128((const __m128i *)((const int16_t *)src + k + 8));
+		__m128i v = _mm_packs_epi16(_mm_srai_epi16(a, 8), _mm_srai_epi16(b, 8));
+		_mm_storeu_si128((__m128i *)((uint8_t *)dst + k), _mm_xor_si128(v, sign));
+	}
+	TAIL(s16_to_u8, k, 1, 2);
+}
+
+static SSE2 void sse2_s16_to_s32(void *dst, const void *src, size_t samples)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)((const int16_t *)src + k));
+		_mm_storeu_si128((__m128i *)((int32_t *)dst + k), _mm_unpacklo_epi16(zero, v));
+		_mm_storeu_si128((__m128i *)((int32_t *)dst + k + 4), _mm_unpackhi_epi16(zero, v));
+	}
+	TAIL(s16_to_s32, k, 4, 2);
+}
+
+static SSE2 void sse2_s32_to_s16(void *dst, const void *src, size_t samples)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)((const int32_t *)src + k));
+		__m128i b = _mm_loadu_si128((const __m128i *)((const int32_t *)src + k + 4));
+		__m128i v = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+		_mm_storeu_si128((__m128i *)((int16_t *)dst + k), v);
+	}
+	TAIL(s32_to_s16, k, 2, 4);
+}
+
+static SSE2 void sse2_s16_to_float(void *dst, const void *src, size_t samples)
+{
+	const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)((const int16_t *)src + k));
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		_mm_storeu_ps((float *)dst + k, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps((float *)dst + k + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+	TAIL(s16_to_float, k, 4, 2);
+}
+
+/* SSE2 has no per lane shifts, the table lookup is as good as it gets */
+static void sse2_ulaw_to_s16(void *dst, const void *src, size_t samples)
+{
+	alsa_oss_convert_scalar.ulaw_to_s16(dst, src, samples);
+}
+
+const alsa_oss_convert_kernels_t alsa_oss_convert_sse2 = {
+	.name = "sse2",
+	.s16_swap = sse2_s16_swap,
+	.u8_to_s16 = sse2_u8_to_s16,
+	.s16_to_u8 = sse2_s16_to_u8,
+	.s16_to_s32 = sse2_s16_to_s32,
+	.s32_to_s16 = sse2_s32_to_s16,
+	.s16_to_float = sse2_s16_to_float,
+	.ulaw_to_s16 = sse2_ulaw_to_s16,
+};
+
+static AVX2 void avx2_s16_swap(void *dst, const void *src, size_t samples)
+{
+	const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+					      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t k;
+
+	for (k = 0; k + 16 <= samples; k += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)((const int16_t *)src + k));
+		_mm256_storeu_si256((__m256i *)((int16_t *)dst + k), _mm256_shuffle_epi8(v, mask));
+	}
+	TAIL(s16_swap, k, 2, 2);
+}
+
+static AVX2 void avx2_u8_to_s16(void *dst, const void *src, size_t samples)
+{
+	const __m128i sign = _mm_set1_epi8((char)0x80);
+	size_t k;
+
+	for (k = 0; k + 16 <= samples; k += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)((const uint8_t *)src + k));
+		__m256i w = _mm256_cvtepu8_epi16(_mm_xor_si128(v, sign));
+		_mm256_storeu_si256((__m256i *)((int16_t *)dst + k), _mm256_slli_epi16(w, 8));
+	}
+	TAIL(u8_to_s16, k, 2, 1);
+}
+
+static AVX2 void avx2_s16_to_u8(void *dst, const void *src, size_t samples)
+{
+	const __m256i sign = _mm256_set1_epi8((char)0x80);
+	size_t k;
+
+	for (k = 0; k + 32 <= samples; k += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)((const int16_t *)src + k));
+		__m256i b = _mm256_loadu_si256((const __m256i *)((const int16_t *)src + k + 16));
+		__m256i v = _mm256_packs_epi16(_mm256_srai_epi16(a, 8), _mm256_srai_epi16(b, 8));
+		/* packs works per 128bit lane, put the quadwords back in order */
+		v = _mm256_permute4x64_epi64(v, 0xd8);
+		_mm256_storeu_si256((__m256i *)((uint8_t *)dst + k), _mm256_xor_si256(v, sign));
+	}
+	TAIL(s16_to_u8, k, 1, 2);
+}
+
+static AVX2 void avx2_s16_to_s32(void *dst, const void *src, size_t samples)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)((const int16_t *)src + k));
+		__m256i w = _mm256_slli_epi32(_mm256_cvtepi16_epi32(v), 16);
+		_mm256_storeu_si256((__m256i *)((int32_t *)dst + k), w);
+	}
+	TAIL(s16_to_s32, k, 4, 2);
+}
+
+static AVX2 void avx2_s32_to_s16(void *dst, const void *src, size_t samples)
+{
+	size_t k;
+
+	for (k = 0; k + 16 <= samples; k += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)((const int32_t *)src + k));
+		__m256i b = _mm256_loadu_si256((const __m256i *)((const int32_t *)src + k + 8));
+		__m256i v = _mm256_packs_epi32(_mm256_srai_epi32(a, 16), _mm256_srai_epi32(b, 16));
+		v = _mm256_permute4x64_epi64(v, 0xd8);
+		_mm256_storeu_si256((__m256i *)((int16_t *)dst + k), v);
+	}
+	TAIL(s32_to_s16, k, 2, 4);
+}
+
+static AVX2 void avx2_s16_to_float(void *dst, const void *src, size_t samples)
+{
+	const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)((const int16_t *)src + k));
+		__m256 f = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v));
+		_mm256_storeu_ps((float *)dst + k, _mm256_mul_ps(f, scale));
+	}
+	TAIL(s16_to_float, k, 4, 2);
+}
+
+/* G.711 u-law decoding done arithmetically with per lane shifts */
+static AVX2 void avx2_ulaw_to_s16(void *dst, const void *src, size_t samples)
+{
+	const __m256i ff = _mm256_set1_epi32(0xff);
+	const __m256i bias = _mm256_set1_epi32(0x84);
+	size_t k;
+
+	for (k = 0; k + 16 <= samples; k += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)((const uint8_t *)src + k));
+		__m256i r[2];
+		int h;
+		for (h = 0; h < 2; h++) {
+			__m256i u = _mm256_xor_si256(_mm256_cvtepu8_epi32(h ? _mm_srli_si128(v, 8) : v), ff);
+			__m256i t = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(u, _mm256_set1_epi32(0x0f)), 3), bias);
+			__m256i seg = _mm256_srli_epi32(_mm256_and_si256(u, _mm256_set1_epi32(0x70)), 4);
+			__m256i neg = _mm256_cmpeq_epi32(_mm256_and_si256(u, _mm256_set1_epi32(0x80)),
+							 _mm256_set1_epi32(0x80));
+			t = _mm256_sllv_epi32(t, seg);
+			r[h] = _mm256_blendv_epi8(_mm256_sub_epi32(t, bias), _mm256_sub_epi32(bias, t), neg);
+		}
+		_mm256_storeu_si256((__m256i *)((int16_t *)dst + k),
+				    _mm256_permute4x64_epi64(_mm256_packs_epi32(r[0], r[1]), 0xd8));
+	}
+	TAIL(ulaw_to_s16, k, 2, 1);
+}
+
+const alsa_oss_convert_kernels_t alsa_oss_convert_avx2 = {
+	.name = "avx2",
+	.s16_swap = avx2_s16_swap,
+	.u8_to_s16 = avx2_u8_to_s16,
+	.s16_to_u8 = avx2_s16_to_u8,
+	.s16_to_s32 = avx2_s16_to_s32,
+	.s32_to_s16 = avx2_s32_to_s16,
+	.s16_to_float = avx2_s16_to_float,
+	.ulaw_to_s16 = avx2_ulaw_to_s16,
+};
+#endif /* ALSA_OSS_CONVERT_X86 */
+
+#ifdef ALSA_OSS_CONVERT_NEON
+#include <arm_neon.h>
+
+static void neon_s16_swap(void *dst, const void *src, size_t samples)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)src + k * 2);
+		vst1q_u8((uint8_t *)dst + k * 2, vrev16q_u8(v));
+	}
+	TAIL(s16_swap, k, 2, 2);
+}
+
+static void neon_u8_to_s16(void *dst, const void *src, size_t samples)
+{
+	const uint8x16_t sign = vdupq_n_u8(0x80);
+	size_t k;
+
+	for (k = 0; k + 16 <= samples; k += 16) {
+		uint8x16_t v = veorq_u8(vld1q_u8((const uint8_t *)src + k), sign);
+		vst1q_u16((uint16_t *)dst + k, vshll_n_u8(vget_low_u8(v), 8));
+		vst1q_u16((uint16_t *)dst + k + 8, vshll_n_u8(vget_high_u8(v), 8));
+	}
+	TAIL(u8_to_s16, k, 2, 1);
+}
+
+static void neon_s16_to_u8(void *dst, const void *src, size_t samples)
+{
+	const uint8x16_t sign = vdupq_n_u8(0x80);
+	size_t k;
+
+	for (k = 0; k + 16 <= samples; k += 16) {
+		int16x8_t a = vld1q_s16((const int16_t *)src + k);
+		int16x8_t b = vld1q_s16((const int16_t *)src + k + 8);
+		int8x16_t v = vcombine_s8(vshrn_n_s16(a, 8), vshrn_n_s16(b, 8));
+		vst1q_u8((uint8_t *)dst + k, veorq_u8(vreinterpretq_u8_s8(v), sign));
+	}
+	TAIL(s16_to_u8, k, 1, 2);
+}
+
+static void neon_s16_to_s32(void *dst, const void *src, size_t samples)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		int16x8_t v = vld1q_s16((const int16_t *)src + k);
+		vst1q_s32((int32_t *)dst + k, vshll_n_s16(vget_low_s16(v), 16));
+		vst1q_s32((int32_t *)dst + k + 4, vshll_n_s16(vget_high_s16(v), 16));
+	}
+	TAIL(s16_to_s32, k, 4, 2);
+}
+
+static void neon_s32_to_s16(void *dst, const void *src, size_t samples)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		int32x4_t a = vld1q_s32((const int32_t *)src + k);
+		int32x4_t b = vld1q_s32((const int32_t *)src + k + 4);
+		vst1q_s16((int16_t *)dst + k, vcombine_s16(vshrn_n_s32(a, 16), vshrn_n_s32(b, 16)));
+	}
+	TAIL(s32_to_s16, k, 2, 4);
+}
+
+static void neon_s16_to_float(void *dst, const void *src, size_t samples)
+{
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		int16x8_t v = vld1q_s16((const int16_t *)src + k);
+		/* fixed point conversion with 15 fractional bits is x / 32768 */
+		vst1q_f32((float *)dst + k, vcvtq_n_f32_s32(vmovl_s16(vget_low_s16(v)), 15));
+		vst1q_f32((float *)dst + k + 4, vcvtq_n_f32_s32(vmovl_s16(vget_high_s16(v)), 15));
+	}
+	TAIL(s16_to_float, k, 4, 2);
+}
+
+static void neon_ulaw_to_s16(void *dst, const void *src, size_t samples)
+{
+	const int16x8_t bias = vdupq_n_s16(0x84);
+	size_t k;
+
+	for (k = 0; k + 8 <= samples; k += 8) {
+		uint8x8_t u8 = vmvn_u8(vld1_u8((const uint8_t *)src + k));
+		int16x8_t u = vreinterpretq_s16_u16(vmovl_u8(u8));
+		int16x8_t t = vaddq_s16(vshlq_n_s16(vandq_s16(u, vdupq_n_s16(0x0f)), 3), bias);
+		int16x8_t seg = vshrq_n_s16(vandq_s16(u, vdupq_n_s16(0x70)), 4);
+		uint16x8_t neg = vtstq_s16(u, vdupq_n_s16(0x80));
+		t = vshlq_s16(t, seg);
+		vst1q_s16((int16_t *)dst + k, vbslq_s16(neg, vsubq_s16(bias, t), vsubq_s16(t, bias)));
+	}
+	TAIL(ulaw_to_s16, k, 2, 1);
+}
+
+const alsa_oss_convert_kernels_t alsa_oss_convert_neon = {
+	.name = "neon",
+	.s16_swap = neon_s16_swap,
+	.u8_to_s16 = neon_u8_to_s16,
+	.s16_to_u8 = neon_s16_to_u8,
+	.s16_to_s32 = neon_s16_to_s32,
+	.s32_to_s16 = neon_s32_to_s16,
+	.s16_to_float = neon_s16_to_float,
+	.ulaw_to_s16 = neon_ulaw_to_s16,
+};
+#endif /* ALSA_OSS_CONVERT_NEON */
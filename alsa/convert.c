@@ -0,0 +1,486 @@
+/*
+ *  OSS -> ALSA compatibility layer
+ *  Sample format conversion
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include "convert.h"
+
+/* G.711 decoding, indexed by the code */
+static int16_t ulaw_to_s16[256];
+static int16_t alaw_to_s16[256];
+/* G.711 encoding, indexed by the top 14 (u-law) or 13 (A-law) bits, offset binary */
+static uint8_t s14_to_ulaw[1 << 14];
+static uint8_t s13_to_alaw[1 << 13];
+static pthread_once_t g711_once = PTHREAD_ONCE_INIT;
+
+static int16_t ulaw_decode(uint8_t u)
+{
+	int t;
+
+	u = ~u;
+	t = ((u & 0x0f) << 3) + 0x84;
+	t <<= (u & 0x70) >> 4;
+	return (u & 0x80) ? 0x84 - t : t - 0x84;
+}
+
+static int16_t alaw_decode(uint8_t a)
+{
+	int t, seg;
+
+	a ^= 0x55;
+	t = (a & 0x0f) << 4;
+	seg = (a & 0x70) >> 4;
+	if (seg == 0)
+		t += 8;
+	else
+		t = (t + 0x108) << (seg - 1);
+	return (a & 0x80) ? t : -t;
+}
+
+/* v is the sample shifted down to 14 bits */
+static uint8_t ulaw_encode(int v)
+{
+	int mask, seg;
+
+	if (v < 0) {
+		v = -v;
+		mask = 0x7f;
+	} else {
+		mask = 0xff;
+	}
+	if (v > 8159)
+		v = 8159;
+	v += 0x84 >> 2;
+	for (seg = 0; seg < 8 && v > (0x40 << seg) - 1; seg++)
+		;
+	if (seg >= 8)
+		return 0x7f ^ mask;
+	return ((seg << 4) | ((v >> (seg + 1)) & 0x0f)) ^ mask;
+}
+
+/* v is the sample shifted down to 13 bits */
+static uint8_t alaw_encode(int v)
+{
+	int mask, seg, a;
+
+	if (v >= 0) {
+		mask = 0xd5;
+	} else {
+		mask = 0x55;
+		v = -v - 1;
+	}
+	for (seg = 0; seg < 8 && v > (0x20 << seg) - 1; seg++)
+		;
+	if (seg >= 8)
+		return 0x7f ^ mask;
+	a = seg << 4;
+	if (seg < 2)
+		a |= (v >> 1) & 0x0f;
+	else
+		a |= (v >> seg) & 0x0f;
+	return a ^ mask;
+}
+
+static void g711_init(void)
+{
+	int k;
+
+	for (k = 0; k < 256; k++) {
+		ulaw_to_s16[k] = ulaw_decode(k);
+		alaw_to_s16[k] = alaw_decode(k);
+	}
+	for (k = 0; k < 1 << 14; k++)
+		s14_to_ulaw[k] = ulaw_encode(k - (1 << 13));
+	for (k = 0; k < 1 << 13; k++)
+		s13_to_alaw[k] = alaw_encode(k - (1 << 12));
+}
+
+int alsa_oss_convert_supported(snd_pcm_format_t format)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S8:
+	case SND_PCM_FORMAT_U8:
+	case SND_PCM_FORMAT_S16_LE:
+	case SND_PCM_FORMAT_S16_BE:
+	case SND_PCM_FORMAT_U16_LE:
+	case SND_PCM_FORMAT_U16_BE:
+	case SND_PCM_FORMAT_S24_LE:
+	case SND_PCM_FORMAT_S24_BE:
+	case SND_PCM_FORMAT_S24_3LE:
+	case SND_PCM_FORMAT_S24_3BE:
+	case SND_PCM_FORMAT_S32_LE:
+	case SND_PCM_FORMAT_S32_BE:
+	case SND_PCM_FORMAT_FLOAT:
+	case SND_PCM_FORMAT_MU_LAW:
+	case SND_PCM_FORMAT_A_LAW:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+#define LE16(p)		((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8)
+#define BE16(p)		((uint32_t)(p)[1] | (uint32_t)(p)[0] << 8)
+#define LE24(p)		(LE16(p) | (uint32_t)(p)[2] << 16)
+#define BE24(p)		((uint32_t)(p)[2] | (uint32_t)(p)[1] << 8 | (uint32_t)(p)[0] << 16)
+#define LE32(p)		(LE24(p) | (uint32_t)(p)[3] << 24)
+#define BE32(p)		((uint32_t)(p)[3] | (uint32_t)(p)[2] << 8 | \
+			 (uint32_t)(p)[1] << 16 | (uint32_t)(p)[0] << 24)
+
+static inline int32_t float_to_s32(const uint8_t *p)
+{
+	float f;
+
+	memcpy(&f, p, 4);
+	if (f != f)
+		return 0;
+	if (f >= 1.0f)
+		return INT32_MAX;
+	if (f < -1.0f)
+		return INT32_MIN;
+	return (int32_t)(f * 2147483648.0f);
+}
+
+/* backwards, so that dst may overlay src */
+#define DECODE(width, expr) \
+	do { \
+		const uint8_t *p = (const uint8_t *)src + samples * (width); \
+		while (samples-- > 0) { \
+			p -= (width); \
+			dst[samples] = (int32_t)(expr); \
+		} \
+	} while (0)
+
+void alsa_oss_convert_to_s32(int32_t *dst, const void *src, size_t samples,
+			     snd_pcm_format_t format)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S8:
+		DECODE(1, (uint32_t)p[0] << 24);
+		break;
+	case SND_PCM_FORMAT_U8:
+		DECODE(1, (uint32_t)(p[0] ^ 0x80) << 24);
+		break;
+	case SND_PCM_FORMAT_S16_LE:
+		DECODE(2, LE16(p) << 16);
+		break;
+	case SND_PCM_FORMAT_S16_BE:
+		DECODE(2, BE16(p) << 16);
+		break;
+	case SND_PCM_FORMAT_U16_LE:
+		DECODE(2, (LE16(p) ^ 0x8000) << 16);
+		break;
+	case SND_PCM_FORMAT_U16_BE:
+		DECODE(2, (BE16(p) ^ 0x8000) << 16);
+		break;
+	case SND_PCM_FORMAT_S24_LE:
+		DECODE(4, LE32(p) << 8);
+		break;
+	case SND_PCM_FORMAT_S24_BE:
+		DECODE(4, BE32(p) << 8);
+		break;
+	case SND_PCM_FORMAT_S24_3LE:
+		DECODE(3, LE24(p) << 8);
+		break;
+	case SND_PCM_FORMAT_S24_3BE:
+		DECODE(3, BE24(p) << 8);
+		break;
+	case SND_PCM_FORMAT_S32_LE:
+		DECODE(4, LE32(p));
+		break;
+	case SND_PCM_FORMAT_S32_BE:
+		DECODE(4, BE32(p));
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		DECODE(4, float_to_s32(p));
+		break;
+	case SND_PCM_FORMAT_MU_LAW:
+		pthread_once(&g711_once, g711_init);
+		DECODE(1, (uint32_t)(uint16_t)ulaw_to_s16[p[0]] << 16);
+		break;
+	case SND_PCM_FORMAT_A_LAW:
+		pthread_once(&g711_once, g711_init);
+		DECODE(1, (uint32_t)(uint16_t)alaw_to_s16[p[0]] << 16);
+		break;
+	default:
+		break;
+	}
+}
+
+#define PUT16(p, v, le) \
+	do { \
+		(p)[!(le)] = (v); \
+		(p)[!!(le)] = (v) >> 8; \
+	} while (0)
+#define PUT24(p, v, le) \
+	do { \
+		(p)[(le) ? 0 : 2] = (v); \
+		(p)[1] = (v) >> 8; \
+		(p)[(le) ? 2 : 0] = (v) >> 16; \
+	} while (0)
+#define PUT32(p, v, le) \
+	do { \
+		(p)[(le) ? 0 : 3] = (v); \
+		(p)[(le) ? 1 : 2] = (v) >> 8; \
+		(p)[(le) ? 2 : 1] = (v) >> 16; \
+		(p)[(le) ? 3 : 0] = (v) >> 24; \
+	} while (0)
+
+/* forwards, so that dst may overlay src */
+#define ENCODE(width, stmt) \
+	do { \
+		uint8_t *p = dst; \
+		size_t k; \
+		for (k = 0; k < samples; k++, p += (width)) { \
+			uint32_t v = src[k]; \
+			stmt; \
+		} \
+	} while (0)
+
+void alsa_oss_convert_from_s32(void *dst, const int32_t *src, size_t samples,
+			       snd_pcm_format_t format)
+{
+	switch (format) {
+	case SND_PCM_FORMAT_S8:
+		ENCODE(1, p[0] = v >> 24);
+		break;
+	case SND_PCM_FORMAT_U8:
+		ENCODE(1, p[0] = (v >> 24) ^ 0x80);
+		break;
+	case SND_PCM_FORMAT_S16_LE:
+		ENCODE(2, v >>= 16; PUT16(p, v, 1));
+		break;
+	case SND_PCM_FORMAT_S16_BE:
+		ENCODE(2, v >>= 16; PUT16(p, v, 0));
+		break;
+	case SND_PCM_FORMAT_U16_LE:
+		ENCODE(2, v = (v >> 16) ^ 0x8000; PUT16(p, v, 1));
+		break;
+	case SND_PCM_FORMAT_U16_BE:
+		ENCODE(2, v = (v >> 16) ^ 0x8000; PUT16(p, v, 0));
+		break;
+	case SND_PCM_FORMAT_S24_LE:
+		ENCODE(4, v = (int32_t)v >> 8; PUT32(p, v, 1));
+		break;
+	case SND_PCM_FORMAT_S24_BE:
+		ENCODE(4, v = (int32_t)v >> 8; PUT32(p, v, 0));
+		break;
+	case SND_PCM_FORMAT_S24_3LE:
+		ENCODE(3, v >>= 8; PUT24(p, v, 1));
+		break;
+	case SND_PCM_FORMAT_S24_3BE:
+		ENCODE(3, v >>= 8; PUT24(p, v, 0));
+		break;
+	case SND_PCM_FORMAT_S32_LE:
+		ENCODE(4, PUT32(p, v, 1));
+		break;
+	case SND_PCM_FORMAT_S32_BE:
+		ENCODE(4, PUT32(p, v, 0));
+		break;
+	case SND_PCM_FORMAT_FLOAT:
+		ENCODE(4, float f = (int32_t)v * (1.0f / 2147483648.0f); memcpy(p, &f, 4));
+		break;
+	case SND_PCM_FORMAT_MU_LAW:
+		pthread_once(&g711_once, g711_init);
+		ENCODE(1, p[0] = s14_to_ulaw[(v >> 18) ^ 0x2000]);
+		break;
+	case SND_PCM_FORMAT_A_LAW:
+		pthread_once(&g711_once, g711_init);
+		ENCODE(1, p[0] = s13_to_alaw[(v >> 19) ^ 0x1000]);
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Scalar direct kernels.  The accessors keep them safe on buffers which
+ * are not aligned to the sample size.
+ */
+static inline int16_t ld16(const uint8_t *p)
+{
+	int16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void st16(uint8_t *p, int16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline int32_t ld32(const uint8_t *p)
+{
+	int32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void st32(uint8_t *p, int32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static void scalar_s16_swap(void *dst, const void *src, size_t samples)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	size_t k;
+
+	for (k = 0; k < samples; k++, s += 2, d += 2) {
+		uint8_t lo = s[0];
+		d[0] = s[1];
+		d[1] = lo;
+	}
+}
+
+static void scalar_u8_to_s16(void *dst, const void *src, size_t samples)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	size_t k;
+
+	for (k = 0; k < samples; k++)
+		st16(d + k * 2, (int16_t)((s[k] ^ 0x80) << 8));
+}
+
+static void scalar_s16_to_u8(void *dst, const void *src, size_t samples)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	size_t k;
+
+	for (k = 0; k < samples; k++)
+		d[k] = (ld16(s + k * 2) >> 8) ^ 0x80;
+}
+
+static void scalar_s16_to_s32(void *dst, const void *src, size_t samples)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	size_t k;
+
+	for (k = 0; k < samples; k++)
+		st32(d + k * 4, (int32_t)((uint32_t)(uint16_t)ld16(s + k * 2) << 16));
+}
+
+static void scalar_s32_to_s16(void *dst, const void *src, size_t samples)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	size_t k;
+
+	for (k = 0; k < samples; k++)
+		st16(d + k * 2, ld32(s + k * 4) >> 16);
+}
+
+static void scalar_s16_to_float(void *dst, const void *src, size_t samples)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	size_t k;
+
+	for (k = 0; k < samples; k++) {
+		float f = ld16(s + k * 2) * (1.0f / 32768.0f);
+		memcpy(d + k * 4, &f, sizeof(f));
+	}
+}
+
+static void scalar_ulaw_to_s16(void *dst, const void *src, size_t samples)
+{
+	const uint8_t *s = src;
+	uint8_t *d = dst;
+	size_t k;
+
+	pthread_once(&g711_once, g711_init);
+	for (k = 0; k < samples; k++)
+		st16(d + k * 2, ulaw_to_s16[s[k]]);
+}
+
+const alsa_oss_convert_kernels_t alsa_oss_convert_scalar = {
+	.name = "scalar",
+	.s16_swap = scalar_s16_swap,
+	.u8_to_s16 = scalar_u8_to_s16,
+	.s16_to_u8 = scalar_s16_to_u8,
+	.s16_to_s32 = scalar_s16_to_s32,
+	.s32_to_s16 = scalar_s32_to_s16,
+	.s16_to_float = scalar_s16_to_float,
+	.ulaw_to_s16 = scalar_ulaw_to_s16,
+};
+
+static const alsa_oss_convert_kernels_t *kernel_sets[4];
+static pthread_once_t kernel_sets_once = PTHREAD_ONCE_INIT;
+
+static void kernel_sets_init(void)
+{
+	int n = 0;
+
+#ifdef ALSA_OSS_CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernel_sets[n++] = &alsa_oss_convert_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		kernel_sets[n++] = &alsa_oss_convert_sse2;
+#endif
+#ifdef ALSA_OSS_CONVERT_NEON
+	kernel_sets[n++] = &alsa_oss_convert_neon;
+#endif
+	kernel_sets[n++] = &alsa_oss_convert_scalar;
+	kernel_sets[n] = NULL;
+}
+
+const alsa_oss_convert_kernels_t *const *alsa_oss_convert_kernel_sets(void)
+{
+	pthread_once(&kernel_sets_once, kernel_sets_init);
+	return kernel_sets;
+}
+
+int alsa_oss_convert_direct(void *dst, snd_pcm_format_t dst_format,
+			    const void *src, snd_pcm_format_t src_format,
+			    size_t samples)
+{
+	const alsa_oss_convert_kernels_t *k = alsa_oss_convert_kernel_sets()[0];
+	alsa_oss_convert_kernel_t f = NULL;
+
+	if ((src_format == SND_PCM_FORMAT_S16_LE && dst_format == SND_PCM_FORMAT_S16_BE) ||
+	    (src_format == SND_PCM_FORMAT_S16_BE && dst_format == SND_PCM_FORMAT_S16_LE))
+		f = k->s16_swap;
+	else if (src_format == SND_PCM_FORMAT_U8 && dst_format == SND_PCM_FORMAT_S16)
+		f = k->u8_to_s16;
+	else if (src_format == SND_PCM_FORMAT_S16 && dst_format == SND_PCM_FORMAT_U8)
+		f = k->s16_to_u8;
+	else if (src_format == SND_PCM_FORMAT_S16 && dst_format == SND_PCM_FORMAT_S32)
+		f = k->s16_to_s32;
+	else if (src_format == SND_PCM_FORMAT_S32 && dst_format == SND_PCM_FORMAT_S16)
+		f = k->s32_to_s16;
+	else if (src_format == SND_PCM_FORMAT_S16 && dst_format == SND_PCM_FORMAT_FLOAT)
+		f = k->s16_to_float;
+	else if (src_format == SND_PCM_FORMAT_MU_LAW && dst_format == SND_PCM_FORMAT_S16)
+		f = k->ulaw_to_s16;
+	if (!f)
+		return -EINVAL;
+	f(dst, src, samples);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef __ALSA_OSS_CONVERT_H
+#define __ALSA_OSS_CONVERT_H
+/*
+ *  OSS -> ALSA compatibility layer
+ *  Sample format conversion
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * Samples go through a full scale signed 32bit representation.  Both
+ * directions may work in place: to_s32 walks backwards so that dst may
+ * start at src, from_s32 walks forwards so that dst may start at src.
+ */
+int alsa_oss_convert_supported(snd_pcm_format_t format);
+void alsa_oss_convert_to_s32(int32_t *dst, const void *src, size_t samples,
+			     snd_pcm_format_t format);
+void alsa_oss_convert_from_s32(void *dst, const int32_t *src, size_t samples,
+			       snd_pcm_format_t format);
+
+/*
+ * Direct kernels for the common pairs, all in the host byte order except
+ * for the swap.  Each CPU flavour provides the whole set, the best one
+ * the CPU can run is picked once.
+ */
+typedef void (*alsa_oss_convert_kernel_t)(void *dst, const void *src, size_t samples);
+
+typedef struct {
+	const char *name;
+	alsa_oss_convert_kernel_t s16_swap;
+	alsa_oss_convert_kernel_t u8_to_s16;
+	alsa_oss_convert_kernel_t s16_to_u8;
+	alsa_oss_convert_kernel_t s16_to_s32;
+	alsa_oss_convert_kernel_t s32_to_s16;
+	alsa_oss_convert_kernel_t s16_to_float;
+	alsa_oss_convert_kernel_t ulaw_to_s16;
+} alsa_oss_convert_kernels_t;
+
+extern const alsa_oss_convert_kernels_t alsa_oss_convert_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+#define ALSA_OSS_CONVERT_X86 1
+extern const alsa_oss_convert_kernels_t alsa_oss_convert_sse2;
+extern const alsa_oss_convert_kernels_t alsa_oss_convert_avx2;
+#endif
+#if defined(__aarch64__)
+#define ALSA_OSS_CONVERT_NEON 1
+extern const alsa_oss_convert_kernels_t alsa_oss_convert_neon;
+#endif
+
+/* the sets this CPU can run, best first, NULL terminated */
+const alsa_oss_convert_kernels_t *const *alsa_oss_convert_kernel_sets(void);
+
+/* returns -EINVAL when there is no direct kernel for the pair */
+int alsa_oss_convert_direct(void *dst, snd_pcm_format_t dst_format,
+			    const void *src, snd_pcm_format_t src_format,
+			    size_t samples);
+
+#endif /* __ALSA_OSS_CONVERT_H */
@@ -0,0 +1,204 @@
+#ifndef __ALSA_OSS_FDTABLE_H
+#define __ALSA_OSS_FDTABLE_H
+/*
+ *  OSS -> ALSA compatibility layer
+ *  fd -> private state table
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * Two level table indexed directly by the file descriptor.  The directory
+ * and the leaves are allocated on the first insert touching them, so an
+ * unused table costs nothing and a lookup is a handful of loads.
+ *
+ * Lookups take no lock: slots, leaves and the directory are published
+ * with release stores.  Inserts and removals are serialized by the table
+ * mutex.  A directory replaced by a bigger one may still be walked by a
+ * reader, so it is never freed; directories only double, which bounds
+ * the waste by the size of the live one.
+ *
+ * Objects removed from the table can still be referenced by a reader
+ * which looked them up just before.  Readers bracket their use with
+ * fd_table_enter()/fd_table_leave() and removed objects are handed to
+ * fd_table_retire(), which frees them once no reader is in flight.
+ */
+
+#define FD_TABLE_LEAF_SHIFT	8
+#define FD_TABLE_LEAF_SIZE	(1 << FD_TABLE_LEAF_SHIFT)
+#define FD_TABLE_LEAF_MASK	(FD_TABLE_LEAF_SIZE - 1)
+
+typedef struct fd_table_dir {
+	unsigned int size;		/* count of leaf slots */
+	struct fd_table_dir *old;	/* replaced directory, kept for readers */
+	void **leaf[0];
+} fd_table_dir_t;
+
+typedef struct fd_table_retired {
+	struct fd_table_retired *next;
+	void (*release)(void *ptr);
+	void *ptr;
+} fd_table_retired_t;
+
+typedef struct {
+	fd_table_dir_t *dir;
+	pthread_mutex_t mutex;
+	unsigned int active;
+	fd_table_retired_t *retired;
+} fd_table_t;
+
+#define FD_TABLE_INITIALIZER	{ NULL, PTHREAD_MUTEX_INITIALIZER, 0, NULL }
+
+static inline void *fd_table_get(fd_table_t *table, int fd)
+{
+	fd_table_dir_t *dir = __atomic_load_n(&table->dir, __ATOMIC_ACQUIRE);
+	void **leaf;
+
+	if (fd < 0 || !dir || (unsigned int)fd >> FD_TABLE_LEAF_SHIFT >= dir->size)
+		return NULL;
+	leaf = __atomic_load_n(&dir->leaf[fd >> FD_TABLE_LEAF_SHIFT], __ATOMIC_ACQUIRE);
+	return leaf ? __atomic_load_n(&leaf[fd & FD_TABLE_LEAF_MASK], __ATOMIC_ACQUIRE) : NULL;
+}
+
+/* called with table->mutex held */
+static inline int fd_table_grow(fd_table_t *table, int fd)
+{
+	fd_table_dir_t *dir = table->dir, *ndir;
+	unsigned int k, size = dir ? dir->size * 2 : 0;
+	long open_max = sysconf(_SC_OPEN_MAX);
+
+	if (open_max > 0 && (unsigned long)open_max > (unsigned long)size << FD_TABLE_LEAF_SHIFT)
+		size = (open_max + FD_TABLE_LEAF_SIZE - 1) >> FD_TABLE_LEAF_SHIFT;
+	if (size <= (unsigned int)fd >> FD_TABLE_LEAF_SHIFT)
+		size = ((unsigned int)fd >> FD_TABLE_LEAF_SHIFT) + 1;
+	ndir = calloc(1, sizeof(*ndir) + size * sizeof(ndir->leaf[0]));
+	if (!ndir)
+		return -ENOMEM;
+	ndir->size = size;
+	ndir->old = dir;
+	for (k = 0; dir && k < dir->size; k++)
+		ndir->leaf[k] = __atomic_load_n(&dir->leaf[k], __ATOMIC_RELAXED);
+	__atomic_store_n(&table->dir, ndir, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static inline int fd_table_set(fd_table_t *table, int fd, void *ptr)
+{
+	void **leaf;
+	int err = 0;
+
+	if (fd < 0)
+		return -EBADF;
+	pthread_mutex_lock(&table->mutex);
+	if (!table->dir || (unsigned int)fd >> FD_TABLE_LEAF_SHIFT >= table->dir->size) {
+		err = fd_table_grow(table, fd);
+		if (err < 0)
+			goto _end;
+	}
+	leaf = table->dir->leaf[fd >> FD_TABLE_LEAF_SHIFT];
+	if (!leaf) {
+		leaf = calloc(FD_TABLE_LEAF_SIZE, sizeof(*leaf));
+		if (!leaf) {
+			err = -ENOMEM;
+			goto _end;
+		}
+		__atomic_store_n(&table->dir->leaf[fd >> FD_TABLE_LEAF_SHIFT], leaf, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&leaf[fd & FD_TABLE_LEAF_MASK], ptr, __ATOMIC_RELEASE);
+ _end:
+	pthread_mutex_unlock(&table->mutex);
+	return err;
+}
+
+static inline void fd_table_clear(fd_table_t *table, int fd)
+{
+	fd_table_dir_t *dir;
+	void **leaf;
+
+	pthread_mutex_lock(&table->mutex);
+	dir = table->dir;
+	if (fd >= 0 && dir && (unsigned int)fd >> FD_TABLE_LEAF_SHIFT < dir->size) {
+		leaf = dir->leaf[fd >> FD_TABLE_LEAF_SHIFT];
+		if (leaf)
+			__atomic_store_n(&leaf[fd & FD_TABLE_LEAF_MASK], NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&table->mutex);
+}
+
+static inline void fd_table_enter(fd_table_t *table)
+{
+	__atomic_add_fetch(&table->active, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void fd_table_reclaim(fd_table_t *table)
+{
+	fd_table_retired_t *list, *last;
+
+	list = __atomic_exchange_n(&table->retired, NULL, __ATOMIC_SEQ_CST);
+	if (!list)
+		return;
+	if (__atomic_load_n(&table->active, __ATOMIC_SEQ_CST) == 0) {
+		while (list) {
+			fd_table_retired_t *next = list->next;
+			list->release(list->ptr);
+			free(list);
+			list = next;
+		}
+		return;
+	}
+	/* somebody came in meanwhile, hand the list to the last one out */
+	for (last = list; last->next; last = last->next)
+		;
+	last->next = __atomic_load_n(&table->retired, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&table->retired, &last->next, list, 0,
+					    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
+	if (__atomic_load_n(&table->active, __ATOMIC_SEQ_CST) == 0)
+		fd_table_reclaim(table);
+}
+
+static inline void fd_table_leave(fd_table_t *table)
+{
+	if (__atomic_sub_fetch(&table->active, 1, __ATOMIC_SEQ_CST) == 0 &&
+	    __atomic_load_n(&table->retired, __ATOMIC_SEQ_CST))
+		fd_table_reclaim(table);
+}
+
+/* ptr must already be cleared from the table */
+static inline void fd_table_retire(fd_table_t *table, void *ptr, void (*release)(void *ptr))
+{
+	fd_table_retired_t *r = malloc(sizeof(*r));
+
+	if (!r)
+		return;		/* leak rather than free under a reader */
+	r->release = release;
+	r->ptr = ptr;
+	r->next = __atomic_load_n(&table->retired, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&table->retired, &r->next, r, 0,
+					    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		;
+	if (__atomic_load_n(&table->active, __ATOMIC_SEQ_CST) == 0)
+		fd_table_reclaim(table);
+}
+
+#endif /* __ALSA_OSS_FDTABLE_H */
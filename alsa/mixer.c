@@ -39,49 +39,65 @@
 #include <alsa/asoundlib.h>
 
 #include "alsa-local.h"
+#include "fdtable.h"
 
 typedef struct _oss_mixer {
 	int fileno;
+	pthread_mutex_t mutex;
+	int closed;
 	snd_mixer_t *mix;
 	unsigned int modify_counter;
 	snd_mixer_elem_t *elems[SOUND_MIXER_NRDEVICES];
-	struct _oss_mixer *next;
 } oss_mixer_t;
 
-static oss_mixer_t *mixer_fds = NULL;
+static fd_table_t mixer_fds = FD_TABLE_INITIALIZER;
 
-static oss_mixer_t *look_for_fd(int fd)
+static inline oss_mixer_t *look_for_fd(int fd)
 {
-	oss_mixer_t *result = mixer_fds;
-	while (result) {
-		if (result->fileno == fd)
-			return result;
-		result = result->next;
+	return fd_table_get(&mixer_fds, fd);
+}
+
+/* lockless lookup, then lock the mixer; pair with put_fd() */
+static oss_mixer_t *get_fd(int fd)
+{
+	oss_mixer_t *mixer;
+
+	fd_table_enter(&mixer_fds);
+	mixer = look_for_fd(fd);
+	if (mixer) {
+		pthread_mutex_lock(&mixer->mutex);
+		if (!mixer->closed)
+			return mixer;
+		pthread_mutex_unlock(&mixer->mutex);
 	}
+	fd_table_leave(&mixer_fds);
 	return NULL;
 }
 
-static void insert_fd(oss_mixer_t *xfd)
+static void put_fd(oss_mixer_t *mixer)
 {
-	xfd->next = mixer_fds;
-	mixer_fds = xfd;
+	int err = errno;
+	pthread_mutex_unlock(&mixer->mutex);
+	fd_table_leave(&mixer_fds);
+	errno = err;
+}
+
+static void free_fd(void *ptr)
+{
+	oss_mixer_t *mixer = ptr;
+	pthread_mutex_destroy(&mixer->mutex);
+	free(mixer);
+}
+
+static int insert_fd(oss_mixer_t *xfd)
+{
+	return fd_table_set(&mixer_fds, xfd->fileno, xfd);
 }
 
 static void remove_fd(oss_mixer_t *xfd)
 {
-	oss_mixer_t *result = mixer_fds, *prev = NULL;
-	while (result) {
-		if (result == xfd) {
-			if (prev == NULL)
-				mixer_fds = xfd->next;
-			else
-				prev->next = xfd->next;
-			return;
-		}
-		prev = result;
-		result = result->next;
-	}
-	assert(0);
+	assert(look_for_fd(xfd->fileno) == xfd);
+	fd_table_clear(&mixer_fds, xfd->fileno);
 }
 
 static int oss_mixer_dev(const char *name, unsigned int index)
@@ -128,12 +144,19 @@ static int oss_mixer_dev(const char *name, unsigned int index)
 int lib_oss_mixer_close(int fd)
 {
 	int err, result = 0;
-	oss_mixer_t *mixer = look_for_fd(fd);
+	oss_mixer_t *mixer = get_fd(fd);
+
+	if (mixer == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	remove_fd(mixer);
+	mixer->closed = 1;
 	err = snd_mixer_close(mixer->mix);
 	if (err < 0)
 		result = err;
-	remove_fd(mixer);
-	free(mixer);
+	fd_table_retire(&mixer_fds, mixer, free_fd);
+	put_fd(mixer);
 	if (result < 0) {
 		errno = -result;
 		result = -1;
@@ -188,14 +211,7 @@ static int oss_mixer_open(int card, int device, int oflag, mode_t mode ATTRIBUTE
 	int result;
 	char name[64];
 
-	char *s = getenv("ALSA_OSS_DEBUG");
-	if (s) {
-		alsa_oss_debug = 1;
-		if (alsa_oss_debug_out == NULL) {
-			if (snd_output_stdio_attach(&alsa_oss_debug_out, stderr, 0) < 0)
-				alsa_oss_debug_out = NULL;
-		}
-	}
+	alsa_oss_debug_init();
 	switch (device) {
 	case OSS_DEVICE_MIXER:
 		sprintf(name, "mixer%d", card);
@@ -223,6 +239,7 @@ static int oss_mixer_open(int card, int device, int oflag, mode_t mode ATTRIBUTE
 		errno = -ENOMEM;
 		return -1;
 	}
+	pthread_mutex_init(&mixer->mutex, NULL);
 	result = snd_mixer_open(&mixer->mix, 0);
 	if (result < 0)
 		goto _error;
@@ -246,12 +263,16 @@ static int oss_mixer_open(int card, int device, int oflag, mode_t mode ATTRIBUTE
 	if (result < 0)
 		goto _error1;
 	mixer->fileno = fd;
-	insert_fd(mixer);
+	result = insert_fd(mixer);
+	if (result < 0)
+		goto _error1;
 	return fd;
  _error1:
 	snd_mixer_close(mixer->mix);
  _error:
 	close(fd);
+	pthread_mutex_destroy(&mixer->mutex);
+	free(mixer);
 	errno = -result;
 	return -1;
 }
@@ -278,23 +299,13 @@ static int oss_mixer_read_recsrc(oss_mixer_t *mixer, unsigned int *ret)
 }
 
 
-int lib_oss_mixer_ioctl(int fd, unsigned long cmd, ...)
+static int oss_mixer_ioctl(oss_mixer_t *mixer, int fd, unsigned long cmd, void *arg)
 {
 	int err = 0;
-	va_list args;
-	void *arg;
-	oss_mixer_t *mixer = look_for_fd(fd);
 	snd_mixer_t *mix;
 	unsigned int dev;
 
-	if (mixer == NULL) {
-		errno = ENODEV;
-		return -1;
-	}
 	mix = mixer->mix;
-	va_start(args, cmd);
-	arg = va_arg(args, void *);
-	va_end(args);
 	DEBUG("ioctl(%d, ", fd);
 	switch (cmd) {
 	case OSS_GETVERSION:
@@ -540,6 +551,25 @@ int lib_oss_mixer_ioctl(int fd, unsigned long cmd, ...)
 	return -1;
 }
 
+int lib_oss_mixer_ioctl(int fd, unsigned long cmd, ...)
+{
+	int result;
+	va_list args;
+	void *arg;
+	oss_mixer_t *mixer = get_fd(fd);
+
+	if (mixer == NULL) {
+		errno = ENODEV;
+		return -1;
+	}
+	va_start(args, cmd);
+	arg = va_arg(args, void *);
+	va_end(args);
+	result = oss_mixer_ioctl(mixer, fd, cmd, arg);
+	put_fd(mixer);
+	return result;
+}
+
 static void error_handler(const char *file ATTRIBUTE_UNUSED,
 			  int line ATTRIBUTE_UNUSED,
 			  const char *func ATTRIBUTE_UNUSED,
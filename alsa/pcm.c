@@ -28,26 +28,89 @@
 #include <sys/poll.h>
 #include <sys/select.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <sched.h>
 #include <linux/soundcard.h>
 #include <alsa/asoundlib.h>
 
 #include "alsa-local.h"
+#include "fdtable.h"
+#include "convert.h"
+#include "resample.h"
 
 int alsa_oss_debug = 0;
 snd_output_t *alsa_oss_debug_out = NULL;
 
+static pthread_once_t alsa_oss_debug_once = PTHREAD_ONCE_INIT;
+
+static void do_alsa_oss_debug_init(void)
+{
+	char *s = getenv("ALSA_OSS_DEBUG");
+	if (s) {
+		alsa_oss_debug = 1;
+		if (snd_output_stdio_attach(&alsa_oss_debug_out, stderr, 0) < 0)
+			alsa_oss_debug_out = NULL;
+	}
+}
+
+void alsa_oss_debug_init(void)
+{
+	pthread_once(&alsa_oss_debug_once, do_alsa_oss_debug_init);
+}
+
+static long long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+#define MMAP_BLOCK	64		/* frames, unit of the mmap delta copy */
+
+typedef struct {
+	unsigned long count;
+	long long last;			/* CLOCK_MONOTONIC us the stream stopped at */
+	long long last_us;		/* time the recovery took */
+	long long max_us;
+	long long total_us;
+} recovery_stats_t;
+
 typedef struct {
 	snd_pcm_t *pcm;
 	snd_pcm_sw_params_t *sw_params;
-	size_t frame_bytes;
+	size_t frame_bytes;		/* in the OSS format */
+	snd_pcm_format_t hw_format;	/* differs from dsp->format when converting */
+	int32_t *conv_buf;		/* conversion scratch of conv_frames frames */
+	snd_pcm_uframes_t conv_frames;
+	unsigned int hw_rate;		/* differs from dsp->rate when resampling */
+	alsa_oss_resampler_t *rs;
+	int32_t *rs_buf;		/* resampled frames not yet transferred */
+	snd_pcm_uframes_t rs_head;
+	snd_pcm_uframes_t rs_count;
+	char *iov_buf;			/* readv()/writev() staging */
+	size_t iov_bytes;
+	char *carry;			/* partial frame between calls */
+	size_t carry_size;
+	size_t carry_bytes;
+	size_t carry_ofs;		/* capture: first byte not yet read */
+	char *coal_buf;			/* playback: staged small writes */
+	size_t coal_limit;		/* 0 = not coalescing */
+	size_t coal_head;
+	size_t coal_bytes;
 	struct {
 		snd_pcm_uframes_t period_size;
 		snd_pcm_uframes_t buffer_size;
@@ -66,83 +129,275 @@ typedef struct {
 		size_t boundary;
 	} oss;
 	unsigned int stopped:1;
+	unsigned int mmap_write:1;	/* write() copies straight into the ring */
+	unsigned int mmap_direct:1;	/* mmap_buffer is the device ring */
+	unsigned int silence_fill:1;	/* runs through underruns */
+	unsigned int poll_valid:1;	/* pollfds matches the current setup */
+	unsigned int polled:1;		/* included by the last poll_prepare */
+	struct pollfd *pollfds;
+	int poll_count;
+	int poll_alloc;
 	void *mmap_buffer;
 	size_t mmap_bytes;
+	size_t mmap_alloc;		/* length of the shadow mapping, 0 = none */
 	snd_pcm_channel_area_t *mmap_areas;
 	snd_pcm_uframes_t mmap_advance;
+	long long advance_since;	/* last underrun or decay of mmap_advance */
+	unsigned int mmap_delta:1;	/* copy only what is new, see oss_dsp_mmap_delta() */
+	uint64_t *mmap_hash;		/* per MMAP_BLOCK of the shadow buffer, as copied */
+	long long copy_since;		/* first mmap copy */
+	snd_pcm_uframes_t avail_min;	/* last committed by poll/select, 0 = unknown */
+	struct {
+		unsigned long sw_params_issued;
+		unsigned long sw_params_skipped;
+		unsigned long coal_writes;
+		unsigned long coal_flushes;
+		recovery_stats_t xruns;
+		recovery_stats_t resumes;
+		unsigned long starved;
+		unsigned long starved_frames;
+		unsigned long pump_updates;
+		unsigned long mmap_late;	/* updates which found playback behind */
+		unsigned long advance_decays;
+		snd_pcm_uframes_t advance_min;
+		snd_pcm_uframes_t advance_max;
+		unsigned long long mmap_delta_bytes;
+		unsigned long long mmap_rewind_bytes;	/* copied by the rewind mode */
+		unsigned long mmap_rewinds;		/* delta mode, for rewritten blocks */
+	} stats;
+	long long xrun_since;		/* stopped by an xrun at, 0 = running */
+	long long suspend_since;	/* suspended at, 0 = running */
+	long long resume_since;		/* first resume attempt, 0 = none pending */
+	unsigned int resume_delay;	/* us, next sleep while suspended */
+	unsigned int busy:1;		/* a transfer or drain is in progress */
+	snd_pcm_uframes_t silence_skipped; /* played as silence, not yet seen by GETOPTR */
+	struct {
+		const void *addr;
+		size_t len;
+	} locked[5];			/* mlock()ed buffers */
+	unsigned int nlocked;
+	unsigned int pump:1;		/* a pump thread owns the pcm */
+	int pump_quit;
+	pthread_t pump_thread;
+	struct pollfd *pump_fds;	/* wakeup eventfd, then the pcm ones */
+	int pump_count;
+	struct {
+		unsigned int seq;	/* odd while being written */
+		snd_pcm_sframes_t delay;
+		snd_pcm_sframes_t avail;
+		snd_pcm_uframes_t hw_ptr;
+	} pump_ptr;
 } oss_dsp_stream_t;
 
 typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t idle;		/* users dropped, a stream no longer busy */
+	unsigned int users;		/* waiting without the mutex */
+	int closed;
 	int hwset;
+	unsigned int nonblock:1;
+	unsigned int no_mmap_write:1;
+	unsigned int no_mmap_direct:1;
+	unsigned int mmap_pump:1;
+	unsigned int no_mmap_delta:1;
+	unsigned int mmap_huge:1;
+	unsigned int silence_fill:1;
+	unsigned int rt:1;		/* promote the first writer */
+	unsigned int rt_done:1;
 	unsigned int channels;
 	unsigned int rate;
+	unsigned int resample;		/* quality, 0 = never */
+	unsigned int mmap_xruns;	/* mmap underruns per minute aimed at */
+	unsigned int coalesce;		/* percent of a period, 0 = never */
 	unsigned int oss_format;
 	snd_pcm_format_t format;
 	unsigned int fragshift;
 	unsigned int maxfrags;
 	unsigned int subdivision;
+	struct {
+		unsigned int oss_format;
+		unsigned int channels;
+		unsigned int rate;
+		unsigned int fragshift;
+		unsigned int maxfrags;
+		unsigned int subdivision;
+	} direct;			/* setup the device ring was handed out with */
 	oss_dsp_stream_t streams[2];
 } oss_dsp_t;
 
 typedef struct fd {
 	int fileno;
 	oss_dsp_t *dsp;
-	void *mmap_area;
-	struct fd *next;
+	void *mmap_area[2];
+	struct fd *mmap_next;
 } fd_t;
 
-static fd_t *pcm_fds = NULL;
+static fd_table_t pcm_fds = FD_TABLE_INITIALIZER;
+static fd_t *pcm_mmap_fds = NULL;
+static pthread_mutex_t pcm_mmap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * As with OSS, a mapping still out when its dsp is closed stays valid
+ * until the application unmaps it: a device ring keeps its pcm open,
+ * stopped, until then, and a shadow buffer the length it was mapped
+ * with, rounded up to whole huge pages, which the application's own
+ * length would not unmap.
+ */
+typedef struct mmap_orphan {
+	void *addr;
+	snd_pcm_t *pcm;			/* closed by munmap(), NULL = none */
+	size_t len;			/* unmapped by munmap(), 0 = none */
+	struct mmap_orphan *next;
+} mmap_orphan_t;
 
+static mmap_orphan_t *mmap_orphans;
 
-static fd_t *look_for_fd(int fd)
+
+static inline fd_t *look_for_fd(int fd)
 {
-	fd_t *result = pcm_fds;
-	while (result) {
-		if (result->fileno == fd)
-			return result;
-		result = result->next;
-	}
+	return fd_table_get(&pcm_fds, fd);
+}
+
+/*
+ * Look up fd and lock its dsp.  The lookup itself is lockless, the
+ * device mutex serializes all users of the same dsp.  Each successful
+ * call must be paired with put_fd().
+ */
+static fd_t *get_fd(int fd)
+{
+	fd_t *xfd;
+
+	fd_table_enter(&pcm_fds);
+	xfd = look_for_fd(fd);
+	if (xfd) {
+		pthread_mutex_lock(&xfd->dsp->mutex);
+		if (!xfd->dsp->closed)
+			return xfd;
+		pthread_mutex_unlock(&xfd->dsp->mutex);
+	}
+	fd_table_leave(&pcm_fds);
 	return NULL;
 }
 
-static inline oss_dsp_t *look_for_dsp(int fd)
+static void put_fd(fd_t *xfd)
+{
+	int err = errno;
+	pthread_mutex_unlock(&xfd->dsp->mutex);
+	fd_table_leave(&pcm_fds);
+	errno = err;
+}
+
+static void free_fd(void *ptr)
 {
-	fd_t *xfd = look_for_fd(fd);
-	return xfd ? xfd->dsp : NULL;
+	fd_t *xfd = ptr;
+	pthread_cond_destroy(&xfd->dsp->idle);
+	pthread_mutex_destroy(&xfd->dsp->mutex);
+	free(xfd->dsp);
+	free(xfd);
 }
 
-static inline oss_dsp_t *look_for_mmap_addr(void * addr)
+/* only the few fds with an active mmap are chained here */
+static fd_t *look_for_mmap_addr(void * addr)
 {
-	fd_t *result = pcm_fds;
+	fd_t *result;
+	pthread_mutex_lock(&pcm_mmap_mutex);
+	result = pcm_mmap_fds;
 	while (result) {
-		if (result->mmap_area == addr)
-			return result->dsp ? result->dsp : NULL;
-		result = result->next;
+		if (result->mmap_area[0] == addr || result->mmap_area[1] == addr)
+			break;
+		result = result->mmap_next;
 	}
-	return NULL;
+	pthread_mutex_unlock(&pcm_mmap_mutex);
+	return result;
 }
 
-static void insert_fd(fd_t *xfd)
+static void insert_mmap_fd(fd_t *xfd, int stream, void *addr)
 {
-	xfd->next = pcm_fds;
-	pcm_fds = xfd;
+	pthread_mutex_lock(&pcm_mmap_mutex);
+	if (!xfd->mmap_area[0] && !xfd->mmap_area[1]) {
+		xfd->mmap_next = pcm_mmap_fds;
+		pcm_mmap_fds = xfd;
+	}
+	xfd->mmap_area[stream] = addr;
+	pthread_mutex_unlock(&pcm_mmap_mutex);
 }
 
-static void remove_fd(fd_t *xfd)
+static void remove_mmap_fd(fd_t *xfd, void *addr)
 {
-	fd_t *result = pcm_fds, *prev = NULL;
-	while (result) {
-		if (result == xfd) {
-			if (prev == NULL)
-				pcm_fds = xfd->next;
-			else
-				prev->next = xfd->next;
-			return;
+	fd_t **result = &pcm_mmap_fds;
+	pthread_mutex_lock(&pcm_mmap_mutex);
+	if (!addr || xfd->mmap_area[0] == addr)
+		xfd->mmap_area[0] = NULL;
+	if (!addr || xfd->mmap_area[1] == addr)
+		xfd->mmap_area[1] = NULL;
+	if (xfd->mmap_area[0] || xfd->mmap_area[1])
+		goto _end;
+	while (*result) {
+		if (*result == xfd) {
+			*result = xfd->mmap_next;
+			break;
 		}
-		prev = result;
-		result = result->next;
+		result = &(*result)->mmap_next;
+	}
+ _end:
+	pthread_mutex_unlock(&pcm_mmap_mutex);
+}
+
+static int mmap_orphan_add(void *addr, snd_pcm_t *pcm, size_t len)
+{
+	mmap_orphan_t *o = calloc(1, sizeof(*o));
+
+	if (!o)
+		return -ENOMEM;
+	o->addr = addr;
+	o->pcm = pcm;
+	o->len = len;
+	pthread_mutex_lock(&pcm_mmap_mutex);
+	o->next = mmap_orphans;
+	mmap_orphans = o;
+	pthread_mutex_unlock(&pcm_mmap_mutex);
+	return 0;
+}
+
+static int mmap_orphan_release(void *addr, size_t len)
+{
+	mmap_orphan_t **p, *o;
+	int err = 0;
+
+	pthread_mutex_lock(&pcm_mmap_mutex);
+	for (p = &mmap_orphans; *p; p = &(*p)->next)
+		if ((*p)->addr == addr)
+			break;
+	o = *p;
+	if (o)
+		*p = o->next;
+	pthread_mutex_unlock(&pcm_mmap_mutex);
+	/* any other shadow buffer is a plain mapping by now */
+	if (!o)
+		return munmap(addr, len);
+	DEBUG("munmap(%p, %lu) after close\n", addr, (unsigned long)len);
+	if (o->pcm)
+		err = snd_pcm_close(o->pcm);
+	else if (munmap(addr, o->len) < 0)
+		err = -errno;
+	free(o);
+	if (err < 0) {
+		errno = -err;
+		return -1;
 	}
-	assert(0);
+	return 0;
+}
+
+static int insert_fd(fd_t *xfd)
+{
+	return fd_table_set(&pcm_fds, xfd->fileno, xfd);
+}
+
+static void remove_fd(fd_t *xfd)
+{
+	assert(look_for_fd(xfd->fileno) == xfd);
+	remove_mmap_fd(xfd, NULL);
+	fd_table_clear(&pcm_fds, xfd->fileno);
 }
 
 static unsigned int ld2(u_int32_t v)
@@ -204,6 +459,287 @@ static int alsa_format_to_oss(snd_pcm_format_t format)
 	}
 }
 
+/*
+ * The poll descriptors of a stream are only queried again when it is
+ * reconfigured, not on each wait.
+ */
+static int stream_poll_refresh(oss_dsp_stream_t *str)
+{
+	int count, err;
+
+	str->poll_valid = 0;
+	count = snd_pcm_poll_descriptors_count(str->pcm);
+	if (count < 0)
+		return count;
+	if (count > str->poll_alloc) {
+		struct pollfd *pollfds = realloc(str->pollfds, count * sizeof(*pollfds));
+		if (!pollfds)
+			return -ENOMEM;
+		str->pollfds = pollfds;
+		str->poll_alloc = count;
+	}
+	err = snd_pcm_poll_descriptors(str->pcm, str->pollfds, count);
+	if (err < 0)
+		return err;
+	str->poll_count = count;
+	str->poll_valid = 1;
+	return count;
+}
+
+static inline int stream_poll_descriptors(oss_dsp_stream_t *str)
+{
+	if (str->poll_valid)
+		return str->poll_count;
+	return stream_poll_refresh(str);
+}
+
+/*
+ * Formats tried when the device lacks the OSS one, lossless ones for the
+ * 8 and 16bit OSS formats first.
+ */
+static const snd_pcm_format_t hw_formats[] = {
+	SND_PCM_FORMAT_S16, SND_PCM_FORMAT_S32, SND_PCM_FORMAT_S24,
+	SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S16_BE,
+	SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S32_BE, SND_PCM_FORMAT_S24_3BE,
+	SND_PCM_FORMAT_FLOAT, SND_PCM_FORMAT_U8, SND_PCM_FORMAT_S8,
+};
+
+/* mmap exposes the device buffer directly, so it never converts */
+static snd_pcm_format_t oss_dsp_hw_format(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					  snd_pcm_hw_params_t *hw)
+{
+	unsigned int k;
+
+	if (str->mmap_buffer ||
+	    snd_pcm_hw_params_test_format(str->pcm, hw, dsp->format) >= 0 ||
+	    !alsa_oss_convert_supported(dsp->format))
+		return dsp->format;
+	for (k = 0; k < sizeof(hw_formats) / sizeof(hw_formats[0]); k++) {
+		if (snd_pcm_hw_params_test_format(str->pcm, hw, hw_formats[k]) >= 0)
+			return hw_formats[k];
+	}
+	return dsp->format;
+}
+
+/* device frames counted at the OSS rate */
+static inline snd_pcm_sframes_t oss_frames(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					   snd_pcm_sframes_t frames)
+{
+	if (!str->rs)
+		return frames;
+	return (long long)frames * dsp->rate / str->hw_rate;
+}
+
+/* valid once hw_format and hw_rate are known */
+static int oss_dsp_resampling(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	return dsp->resample && str->hw_rate != dsp->rate && !str->mmap_buffer &&
+		alsa_oss_convert_supported(dsp->format) &&
+		alsa_oss_convert_supported(str->hw_format);
+}
+
+static void oss_dsp_conv_free(oss_dsp_stream_t *str)
+{
+	free(str->conv_buf);
+	str->conv_buf = NULL;
+	str->conv_frames = 0;
+	alsa_oss_resampler_free(str->rs);
+	str->rs = NULL;
+	free(str->rs_buf);
+	str->rs_buf = NULL;
+	str->rs_head = 0;
+	str->rs_count = 0;
+}
+
+static void oss_dsp_rs_reset(oss_dsp_stream_t *str)
+{
+	if (!str->rs)
+		return;
+	alsa_oss_resampler_reset(str->rs);
+	str->rs_head = 0;
+	str->rs_count = 0;
+}
+
+/*
+ * The resampler consumes one chunk of conv_frames frames at a time, which
+ * is sized so that either side of it is about a period of the device.
+ */
+static int oss_dsp_conv_setup(oss_dsp_t *dsp, oss_dsp_stream_t *str, int stream)
+{
+	snd_pcm_uframes_t frames = str->alsa.period_size;
+	unsigned int in_rate, out_rate;
+	int resample;
+
+	resample = oss_dsp_resampling(dsp, str);
+	if (str->hw_format == dsp->format && !resample) {
+		oss_dsp_conv_free(str);
+		return 0;
+	}
+	alsa_oss_resampler_free(str->rs);
+	str->rs = NULL;
+	free(str->rs_buf);
+	str->rs_buf = NULL;
+	str->rs_head = 0;
+	str->rs_count = 0;
+	if (resample && stream == SND_PCM_STREAM_PLAYBACK) {
+		frames = (unsigned long long)frames * dsp->rate / str->hw_rate;
+		if (frames < 16)
+			frames = 16;
+	} else if (frames < 256)
+		frames = 256;
+	if (frames != str->conv_frames) {
+		int32_t *buf = realloc(str->conv_buf, frames * dsp->channels * sizeof(*buf));
+		if (!buf)
+			return -ENOMEM;
+		str->conv_buf = buf;
+		str->conv_frames = frames;
+	}
+	if (resample) {
+		in_rate = stream == SND_PCM_STREAM_PLAYBACK ? dsp->rate : str->hw_rate;
+		out_rate = stream == SND_PCM_STREAM_PLAYBACK ? str->hw_rate : dsp->rate;
+		str->rs = alsa_oss_resampler_new(in_rate, out_rate, dsp->channels,
+						 dsp->resample, frames);
+		if (!str->rs)
+			return -ENOMEM;
+		str->rs_buf = malloc(alsa_oss_resampler_max_out(str->rs, frames) *
+				     dsp->channels * sizeof(*str->rs_buf));
+		if (!str->rs_buf)
+			return -ENOMEM;
+		DEBUG("Resampling %u to %u Hz in software (%s)\n", in_rate, out_rate,
+		      alsa_oss_resample_quality_name(dsp->resample));
+	}
+	if (str->hw_format != dsp->format)
+		DEBUG("Converting %s to %s in software\n", snd_pcm_format_name(dsp->format),
+		      snd_pcm_format_name(str->hw_format));
+	return 0;
+}
+
+static int oss_dsp_coal_setup(oss_dsp_t *dsp, oss_dsp_stream_t *str, int stream)
+{
+	size_t limit = 0;
+
+	str->coal_head = 0;
+	str->coal_bytes = 0;
+	if (dsp->coalesce && stream == SND_PCM_STREAM_PLAYBACK && !str->mmap_buffer) {
+		limit = str->oss.period_size * str->frame_bytes * dsp->coalesce / 100;
+		limit -= limit % str->frame_bytes;
+	}
+	if (limit > str->coal_limit) {
+		char *buf = realloc(str->coal_buf, limit);
+		if (!buf) {
+			str->coal_limit = 0;
+			return -ENOMEM;
+		}
+		str->coal_buf = buf;
+	}
+	str->coal_limit = limit;
+	return 0;
+}
+
+/*
+ * ALSA_OSS_RT=[fifo:|rr:]<priority> moves the first thread writing to a
+ * dsp to real-time scheduling and locks the stream buffers in memory.
+ * As rtkit does, RLIMIT_RTTIME is bounded first (ALSA_OSS_RTTIME us,
+ * 200ms unless already lower, 0 leaves it alone) so that a thread
+ * spinning at real-time priority gets SIGXCPU instead of hanging the box.
+ */
+static struct {
+	int policy;
+	int priority;			/* 0 = off */
+	rlim_t rttime;
+} rt_config;
+
+static pthread_once_t rt_config_once = PTHREAD_ONCE_INIT;
+
+static void do_rt_config_init(void)
+{
+	char *s = getenv("ALSA_OSS_RT"), *end;
+	int prio, min, max;
+
+	rt_config.policy = SCHED_FIFO;
+	rt_config.rttime = 200000;
+	if (!s || !*s)
+		return;
+	if (!strncmp(s, "fifo:", 5))
+		s += 5;
+	else if (!strncmp(s, "rr:", 3)) {
+		rt_config.policy = SCHED_RR;
+		s += 3;
+	}
+	prio = strtol(s, &end, 10);
+	if (end == s || prio <= 0)
+		return;
+	min = sched_get_priority_min(rt_config.policy);
+	max = sched_get_priority_max(rt_config.policy);
+	rt_config.priority = prio < min ? min : prio > max ? max : prio;
+	s = getenv("ALSA_OSS_RTTIME");
+	if (s && *s)
+		rt_config.rttime = strtoul(s, NULL, 10);
+}
+
+static void oss_dsp_lock_region(oss_dsp_stream_t *str, const void *addr, size_t len)
+{
+	if (!addr || !len || str->nlocked >= sizeof(str->locked) / sizeof(str->locked[0]))
+		return;
+	if (mlock(addr, len) < 0) {
+		DEBUG("mlock(%p, %ld): %s\n", addr, (long)len, strerror(errno));
+		return;
+	}
+	str->locked[str->nlocked].addr = addr;
+	str->locked[str->nlocked].len = len;
+	str->nlocked++;
+}
+
+static void oss_dsp_lock_buffers(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	size_t bytes = dsp->channels * sizeof(int32_t);
+
+	oss_dsp_lock_region(str, str->conv_buf, str->conv_frames * bytes);
+	if (str->rs)
+		oss_dsp_lock_region(str, str->rs_buf,
+				    alsa_oss_resampler_max_out(str->rs, str->conv_frames) * bytes);
+	oss_dsp_lock_region(str, str->iov_buf, str->iov_bytes);
+	oss_dsp_lock_region(str, str->carry, str->carry_size);
+	oss_dsp_lock_region(str, str->coal_buf, str->coal_limit);
+}
+
+/* before any of the buffers is reallocated or freed */
+static void oss_dsp_unlock_buffers(oss_dsp_stream_t *str)
+{
+	unsigned int k;
+
+	for (k = 0; k < str->nlocked; k++)
+		munlock(str->locked[k].addr, str->locked[k].len);
+	str->nlocked = 0;
+}
+
+static void oss_dsp_rt_promote(oss_dsp_t *dsp)
+{
+	struct sched_param param;
+	struct rlimit rl;
+	int k, err;
+
+	dsp->rt_done = 1;
+	if (rt_config.rttime && getrlimit(RLIMIT_RTTIME, &rl) == 0 &&
+	    (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > rt_config.rttime)) {
+		rl.rlim_cur = rt_config.rttime;
+		if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max)
+			rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_RTTIME, &rl) < 0)
+			DEBUG("RLIMIT_RTTIME: %s\n", strerror(errno));
+	}
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = rt_config.priority;
+	err = pthread_setschedparam(pthread_self(), rt_config.policy, &param);
+	DEBUG("Real-time scheduling (%s, %d): %s\n",
+	      rt_config.policy == SCHED_RR ? "rr" : "fifo", rt_config.priority,
+	      err ? strerror(err) : "ok");
+	for (k = 0; k < 2; k++) {
+		if (dsp->streams[k].pcm)
+			oss_dsp_lock_buffers(dsp, &dsp->streams[k]);
+	}
+}
+
 static int oss_dsp_hw_params(oss_dsp_t *dsp)
 {
 	int k;
@@ -213,14 +749,26 @@ static int oss_dsp_hw_params(oss_dsp_t *dsp)
 		snd_pcm_hw_params_t *hw;
 		int err;
 		unsigned int rate, periods_min;
-		if (!pcm)
+		/* its ring is mapped by the application, the setup cannot change */
+		if (!pcm || str->mmap_direct)
 			continue;
+		str->poll_valid = 0;
+		oss_dsp_unlock_buffers(str);
 		dsp->format = oss_format_to_alsa(dsp->oss_format);
 		str->frame_bytes = snd_pcm_format_physical_width(dsp->format) * dsp->channels / 8;
+		str->carry_bytes = 0;
+		if (str->frame_bytes > str->carry_size) {
+			char *carry = realloc(str->carry, str->frame_bytes);
+			if (!carry)
+				return -ENOMEM;
+			str->carry = carry;
+			str->carry_size = str->frame_bytes;
+		}
 		snd_pcm_hw_params_alloca(&hw);
 		snd_pcm_hw_params_any(pcm, hw);
 
-		err = snd_pcm_hw_params_set_format(pcm, hw, dsp->format);
+		str->hw_format = oss_dsp_hw_format(dsp, str, hw);
+		err = snd_pcm_hw_params_set_format(pcm, hw, str->hw_format);
 		if (err < 0)
 			return err;
 		err = snd_pcm_hw_params_set_channels(pcm, hw, dsp->channels);
@@ -230,6 +778,7 @@ static int oss_dsp_hw_params(oss_dsp_t *dsp)
 		err = snd_pcm_hw_params_set_rate_near(pcm, hw, &rate, 0);
 		if (err < 0)
 			return err;
+		str->hw_rate = rate;
 #if 0
 		err = snd_pcm_hw_params_set_periods_integer(pcm, hw);
 		if (err < 0)
@@ -239,6 +788,7 @@ static int oss_dsp_hw_params(oss_dsp_t *dsp)
 		if (str->mmap_buffer) {
 			snd_pcm_uframes_t size;
 			snd_pcm_access_mask_t *mask;
+			str->mmap_write = 0;
 			snd_pcm_access_mask_alloca(&mask);
 			snd_pcm_access_mask_any(mask);
 			snd_pcm_access_mask_set(mask, SND_PCM_ACCESS_MMAP_INTERLEAVED);
@@ -259,9 +809,15 @@ static int oss_dsp_hw_params(oss_dsp_t *dsp)
 			if (err < 0)
 				return err;
 		} else {
-			err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
-			if (err < 0)
-				return err;
+			/* nothing to convert: write() can fill the ring itself */
+			str->mmap_write = k == SND_PCM_STREAM_PLAYBACK && !dsp->no_mmap_write &&
+				str->hw_format == dsp->format && !oss_dsp_resampling(dsp, str) &&
+				snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED) >= 0;
+			if (!str->mmap_write) {
+				err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
+				if (err < 0)
+					return err;
+			}
 			periods_min = 2;
 			if (!dsp->maxfrags) {
 				err = snd_pcm_hw_params_set_periods_min(pcm, hw, &periods_min, 0);
@@ -308,6 +864,8 @@ static int oss_dsp_hw_params(oss_dsp_t *dsp)
 		err = snd_pcm_hw_params(pcm, hw);
 		if (err < 0)
 			return err;
+		/* a failure here is retried on the first wait */
+		stream_poll_refresh(str);
 #if 0
 		if (alsa_oss_debug && alsa_oss_debug_out)
 			snd_pcm_dump_setup(pcm, alsa_oss_debug_out);
@@ -321,21 +879,43 @@ static int oss_dsp_hw_params(oss_dsp_t *dsp)
 		err = snd_pcm_hw_params_get_buffer_size(hw, &str->alsa.buffer_size);
 		if (err < 0)
 			return err;
+		err = oss_dsp_conv_setup(dsp, str, k);
+		if (err < 0)
+			return err;
+		if (k == SND_PCM_STREAM_PLAYBACK)
+			DEBUG("Playback writes through %s\n",
+			      str->mmap_buffer ? "the mmap shadow buffer" :
+			      str->mmap_write ? "mmap_begin/commit" :
+			      str->conv_buf ? "the conversion buffer" : "snd_pcm_writei");
 		if (str->mmap_buffer == NULL) {
-			str->oss.buffer_size = 1 << ld2(str->alsa.buffer_size);
-			if (str->oss.buffer_size < str->alsa.buffer_size)
+			snd_pcm_uframes_t buffer_size = oss_frames(dsp, str, str->alsa.buffer_size);
+			snd_pcm_uframes_t period_size = oss_frames(dsp, str, str->alsa.period_size);
+			str->oss.buffer_size = 1 << ld2(buffer_size);
+			if (str->oss.buffer_size < buffer_size)
 				str->oss.buffer_size *= 2;
-			str->oss.period_size = 1 << ld2(str->alsa.period_size);
-			if (str->oss.period_size < str->alsa.period_size)
+			str->oss.period_size = 1 << ld2(period_size);
+			if (str->oss.period_size < period_size)
 				str->oss.period_size *= 2;
 		} else {
-			str->oss.buffer_size = str->alsa.mmap_period_bytes / str->frame_bytes;
-			str->oss.period_size = str->alsa.mmap_buffer_bytes / str->frame_bytes;
+			str->oss.buffer_size = str->alsa.mmap_buffer_bytes / str->frame_bytes;
+			str->oss.period_size = str->alsa.mmap_period_bytes / str->frame_bytes;
 		}
 		str->oss.periods = str->oss.buffer_size / str->oss.period_size;
+		err = oss_dsp_coal_setup(dsp, str, k);
+		if (err < 0)
+			return err;
 		if (str->mmap_areas)
 			free(str->mmap_areas);
 		str->mmap_areas = NULL;
+		free(str->mmap_hash);
+		str->mmap_hash = NULL;
+		str->mmap_delta = 0;
+		if (str->mmap_buffer && k == SND_PCM_STREAM_PLAYBACK && !dsp->no_mmap_delta &&
+		    str->oss.buffer_size % MMAP_BLOCK == 0) {
+			str->mmap_hash = calloc(str->oss.buffer_size / MMAP_BLOCK,
+						sizeof(*str->mmap_hash));
+			str->mmap_delta = str->mmap_hash != NULL;
+		}
 		if (str->mmap_buffer) {
 			unsigned int c;
 			snd_pcm_channel_area_t *a;
@@ -356,7 +936,11 @@ static int oss_dsp_hw_params(oss_dsp_t *dsp)
 		str->oss.boundary = (0x3fffffff / str->oss.buffer_size) * str->oss.buffer_size;
 		str->alsa.appl_ptr = 0;
 		str->alsa.old_hw_ptr = 0;
+		str->silence_skipped = 0;
 		str->mmap_advance = str->oss.period_size;
+		str->advance_since = 0;
+		if (dsp->rt_done)
+			oss_dsp_lock_buffers(dsp, str);
 	}
 	return 0;
 }
@@ -377,18 +961,25 @@ static int oss_dsp_sw_params(oss_dsp_t *dsp)
 		snd_pcm_sw_params_set_start_threshold(pcm, sw, 
 						      str->stopped ? str->alsa.buffer_size + 1 :
 						      str->alsa.period_size);
-#if 1
-		snd_pcm_sw_params_set_stop_threshold(pcm, sw,
-						     str->mmap_buffer ? LONG_MAX :
-						     str->alsa.buffer_size);
-#else
-		snd_pcm_sw_params_set_stop_threshold(pcm, sw,
-						     LONG_MAX);
-		snd_pcm_sw_params_set_silence_threshold(pcm, sw,
-						       str->alsa.period_size);
-		snd_pcm_sw_params_set_silence_size(pcm, sw,
-						   str->alsa.period_size);
-#endif
+		str->silence_fill = k == SND_PCM_STREAM_PLAYBACK && dsp->silence_fill &&
+			!str->mmap_buffer;
+		if (str->silence_fill) {
+			/* keep running, the driver fills what was played with silence */
+			snd_pcm_uframes_t boundary;
+			err = snd_pcm_sw_params_get_boundary(sw, &boundary);
+			if (err < 0)
+				return err;
+			snd_pcm_sw_params_set_stop_threshold(pcm, sw, boundary);
+			snd_pcm_sw_params_set_silence_threshold(pcm, sw, 0);
+			snd_pcm_sw_params_set_silence_size(pcm, sw, boundary);
+		} else {
+			snd_pcm_sw_params_set_stop_threshold(pcm, sw,
+							     str->mmap_buffer ? LONG_MAX :
+							     str->alsa.buffer_size);
+			snd_pcm_sw_params_set_silence_threshold(pcm, sw, 0);
+			snd_pcm_sw_params_set_silence_size(pcm, sw, 0);
+		}
+		str->avail_min = 0;
 		err = snd_pcm_sw_params(pcm, sw);
 		if (err < 0)
 			return err;
@@ -402,9 +993,39 @@ static int oss_dsp_sw_params(oss_dsp_t *dsp)
 	return 0;
 }
 
+static snd_pcm_sframes_t oss_dsp_rs_flush(oss_dsp_t *dsp, oss_dsp_stream_t *str);
+static int oss_dsp_coal_flush(oss_dsp_t *dsp, oss_dsp_stream_t *str);
+static void oss_dsp_pump_stop_all(oss_dsp_t *dsp);
+static int oss_dsp_drain(oss_dsp_t *dsp, oss_dsp_stream_t *str);
+
+static int oss_dsp_direct(oss_dsp_t *dsp)
+{
+	return dsp->streams[0].mmap_direct || dsp->streams[1].mmap_direct;
+}
+
 static int oss_dsp_params(oss_dsp_t *dsp)
 {
 	int err;
+	if (oss_dsp_direct(dsp) &&
+	    (dsp->oss_format != dsp->direct.oss_format ||
+	     dsp->channels != dsp->direct.channels ||
+	     dsp->rate != dsp->direct.rate ||
+	     dsp->fragshift != dsp->direct.fragshift ||
+	     dsp->maxfrags != dsp->direct.maxfrags ||
+	     dsp->subdivision != dsp->direct.subdivision)) {
+		/* as with OSS, no more changes once the buffer is mapped */
+		dsp->oss_format = dsp->direct.oss_format;
+		dsp->channels = dsp->direct.channels;
+		dsp->rate = dsp->direct.rate;
+		dsp->fragshift = dsp->direct.fragshift;
+		dsp->maxfrags = dsp->direct.maxfrags;
+		dsp->subdivision = dsp->direct.subdivision;
+		return -EBUSY;
+	}
+	oss_dsp_pump_stop_all(dsp);
+	/* staged bytes are in the old format, what does not fit is dropped */
+	if (dsp->hwset)
+		oss_dsp_coal_flush(dsp, &dsp->streams[SND_PCM_STREAM_PLAYBACK]);
 	dsp->hwset = 0;
 	err = oss_dsp_hw_params(dsp);
 	if (err < 0) 
@@ -426,39 +1047,105 @@ static int oss_dsp_params(oss_dsp_t *dsp)
 	return 0;
 }
 
+static void dump_recovery(int fd, const char *name, const char *what, recovery_stats_t *st)
+{
+	if (!st->count)
+		return;
+	DEBUG("stats(%d, %s): %lu %s, last at %lld us, recovery last %lld max %lld avg %lld us\n",
+	      fd, name, st->count, what, st->last, st->last_us, st->max_us,
+	      st->total_us / (long long)st->count);
+}
+
+static void dump_stream_stats(int fd, int stream, oss_dsp_stream_t *str)
+{
+	const char *name = stream == SND_PCM_STREAM_PLAYBACK ? "playback" : "capture";
+
+	DEBUG("stats(%d, %s): sw_params issued %lu, skipped %lu\n", fd, name,
+	      str->stats.sw_params_issued, str->stats.sw_params_skipped);
+	dump_recovery(fd, name, "xruns", &str->stats.xruns);
+	dump_recovery(fd, name, "resumes", &str->stats.resumes);
+	if (str->stats.starved)
+		DEBUG("stats(%d, %s): starved %lu times, %lu frames of silence\n", fd, name,
+		      str->stats.starved, str->stats.starved_frames);
+	if (str->stats.coal_writes)
+		DEBUG("stats(%d, %s): %lu writes coalesced into %lu transfers\n", fd, name,
+		      str->stats.coal_writes, str->stats.coal_flushes);
+	if (str->stats.advance_max)
+		DEBUG("stats(%d, %s): mmap advance %lu frames (min %lu, max %lu), "
+		      "%lu late updates, %lu decays\n", fd, name,
+		      (unsigned long)str->mmap_advance, (unsigned long)str->stats.advance_min,
+		      (unsigned long)str->stats.advance_max, str->stats.mmap_late,
+		      str->stats.advance_decays);
+	if (str->copy_since) {
+		long long us = now_us() - str->copy_since;
+		if (us > 0)
+			DEBUG("stats(%d, %s): mmap copies %llu B/s in delta mode "
+			      "(%lu rewinds), %llu B/s in rewind mode\n", fd, name,
+			      str->stats.mmap_delta_bytes * 1000000ULL / us,
+			      str->stats.mmap_rewinds,
+			      str->stats.mmap_rewind_bytes * 1000000ULL / us);
+	}
+	if (str->stats.pump_updates)
+		DEBUG("stats(%d, %s): %lu pump updates\n", fd, name, str->stats.pump_updates);
+}
+
 int lib_oss_pcm_close(int fd)
 {
 	int result = 0;
 	int k;
-	fd_t *xfd = look_for_fd(fd);
+	fd_t *xfd = get_fd(fd);
 	oss_dsp_t *dsp;
+	oss_dsp_stream_t *str;
 	
 	if (xfd == NULL) {
 		errno = ENOENT;
 		return -1;
 	}
 	dsp = xfd->dsp;
+	remove_fd(xfd);
+	dsp->closed = 1;
+	/* waiting transfers give up, see oss_dsp_wait() */
+	pthread_cond_broadcast(&dsp->idle);
+	oss_dsp_pump_stop_all(dsp);
+	str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
+	if (str->pcm && snd_pcm_state(str->pcm) != SND_PCM_STATE_OPEN)
+		oss_dsp_drain(dsp, str);
+	while (dsp->users)
+		pthread_cond_wait(&dsp->idle, &dsp->mutex);
 	for (k = 0; k < 2; ++k) {
-		oss_dsp_stream_t *str = &dsp->streams[k];
+		str = &dsp->streams[k];
+		if (str->pcm)
+			dump_stream_stats(fd, k, str);
+		oss_dsp_unlock_buffers(str);
+		/* huge pages: the application's length would not unmap them */
+		if (str->mmap_alloc && str->mmap_alloc != str->mmap_bytes)
+			mmap_orphan_add(str->mmap_buffer, NULL, str->mmap_alloc);
 		if (str->sw_params)
 			snd_pcm_sw_params_free(str->sw_params);
+		free(str->pollfds);
+		free(str->pump_fds);
+		free(str->mmap_hash);
+		free(str->iov_buf);
+		free(str->carry);
+		free(str->coal_buf);
 	}
 	for (k = 0; k < 2; ++k) {
 		int err;
-		oss_dsp_stream_t *str = &dsp->streams[k];
+		str = &dsp->streams[k];
 		if (!str->pcm)
 			continue;
-		if (k == SND_PCM_STREAM_PLAYBACK) {
-			if (snd_pcm_state(str->pcm) != SND_PCM_STATE_OPEN)
-				snd_pcm_drain(str->pcm);
+		oss_dsp_conv_free(str);
+		if (str->mmap_direct && mmap_orphan_add(str->mmap_buffer, str->pcm, 0) == 0) {
+			snd_pcm_drop(str->pcm);
+			continue;
 		}
 		err = snd_pcm_close(str->pcm);
 		if (err < 0)
 			result = err;
 	}
-	remove_fd(xfd);
-	free(dsp);
-	free(xfd);
+	/* freed once the lockless readers which may still see it are gone */
+	fd_table_retire(&pcm_fds, xfd, free_fd);
+	put_fd(xfd);
 	if (result < 0) {
 		errno = -result;
 		result = -1;
@@ -472,8 +1159,8 @@ int lib_oss_pcm_close(int fd)
 	return 0;
 }
 
-static int open_pcm(oss_dsp_t *dsp, const char *name, unsigned int pcm_mode,
-		    unsigned int streams)
+/* the pcm stays non-blocking whatever the fd, see oss_dsp_wait() */
+static int open_pcm(oss_dsp_t *dsp, const char *name, unsigned int streams)
 {
 	int k, result;
 
@@ -490,9 +1177,7 @@ static int open_pcm(oss_dsp_t *dsp, const char *name, unsigned int pcm_mode,
 				result = 0;
 			}
 			break;
-		} else if (! pcm_mode)
-			/* reset the blocking mode */
-			snd_pcm_nonblock(dsp->streams[k].pcm, 0);
+		}
 	}
 	return result;
 }
@@ -500,22 +1185,15 @@ static int open_pcm(oss_dsp_t *dsp, const char *name, unsigned int pcm_mode,
 static int oss_dsp_open(int card, int device, int oflag, mode_t mode ATTRIBUTE_UNUSED)
 {
 	oss_dsp_t *dsp;
-	unsigned int pcm_mode = 0;
 	unsigned int streams, k;
 	int format = AFMT_MU_LAW;
 	int fd = -1;
 	fd_t *xfd;
 	int result;
 	char name[64];
+	char *s;
 
-	char *s = getenv("ALSA_OSS_DEBUG");
-	if (s) {
-		alsa_oss_debug = 1;
-		if (alsa_oss_debug_out == NULL) {
-			if (snd_output_stdio_attach(&alsa_oss_debug_out, stderr, 0) < 0)
-				alsa_oss_debug_out = NULL;
-		}
-	}
+	alsa_oss_debug_init();
 	switch (device) {
 	case OSS_DEVICE_DSP:
 		format = AFMT_U8;
@@ -535,8 +1213,6 @@ static int oss_dsp_open(int card, int device, int oflag, mode_t mode ATTRIBUTE_U
 		errno = ENOENT;
 		return -1;
 	}
-	if (oflag & O_NONBLOCK)
-		pcm_mode = SND_PCM_NONBLOCK;
 	switch (oflag & O_ACCMODE) {
 	case O_RDONLY:
 		streams = 1 << SND_PCM_STREAM_CAPTURE;
@@ -567,8 +1243,33 @@ static int oss_dsp_open(int card, int device, int oflag, mode_t mode ATTRIBUTE_U
 		goto _error;
 	}
 	xfd->dsp = dsp;
+	pthread_mutex_init(&dsp->mutex, NULL);
+	pthread_cond_init(&dsp->idle, NULL);
 	dsp->channels = 1;
 	dsp->rate = 8000;
+	dsp->resample = alsa_oss_resample_quality(getenv("ALSA_OSS_RESAMPLE"));
+	s = getenv("ALSA_OSS_COALESCE");
+	if (s && *s) {
+		int pct = atoi(s);
+		dsp->coalesce = pct < 0 ? 0 : pct > 100 ? 100 : pct;
+	}
+	s = getenv("ALSA_OSS_SILENCE");
+	dsp->silence_fill = s && *s && *s != '0';
+	s = getenv("ALSA_OSS_MMAP_WRITE");
+	dsp->no_mmap_write = s && *s == '0';
+	s = getenv("ALSA_OSS_MMAP_DIRECT");
+	dsp->no_mmap_direct = s && *s == '0';
+	s = getenv("ALSA_OSS_MMAP_XRUNS");
+	dsp->mmap_xruns = s && *s ? (unsigned int)atoi(s) : 1;
+	s = getenv("ALSA_OSS_MMAP_DELTA");
+	dsp->no_mmap_delta = s && *s == '0';
+	s = getenv("ALSA_OSS_MMAP_HUGE");
+	dsp->mmap_huge = s && *s && *s != '0';
+	s = getenv("ALSA_OSS_MMAP_PUMP");
+	dsp->mmap_pump = s && *s && *s != '0';
+	pthread_once(&rt_config_once, do_rt_config_init);
+	dsp->rt = rt_config.priority > 0;
+	dsp->nonblock = !!(oflag & O_NONBLOCK);
 	dsp->oss_format = format;
 	result = -EINVAL;
 	for (k = 0; k < 2; ++k) {
@@ -581,16 +1282,16 @@ static int oss_dsp_open(int card, int device, int oflag, mode_t mode ATTRIBUTE_U
 	s = getenv("ALSA_OSS_PCM_DEVICE");
 	result = -ENODEV;
 	if (s && *s)
-		result = open_pcm(dsp, s, pcm_mode, streams);
+		result = open_pcm(dsp, s, streams);
 	if (result < 0)
-		result = open_pcm(dsp, name, pcm_mode, streams);
+		result = open_pcm(dsp, name, streams);
 	if (result < 0) {
 		/* try to open the default pcm as fallback */
 		if (card == 0 && (device == OSS_DEVICE_DSP || device == OSS_DEVICE_AUDIO))
 			strcpy(name, "default");
 		else
 			sprintf(name, "default:%d", card);
-		result = open_pcm(dsp, name, pcm_mode, streams);
+		result = open_pcm(dsp, name, streams);
 		if (result < 0)
 			goto _error;
 	}
@@ -600,7 +1301,9 @@ static int oss_dsp_open(int card, int device, int oflag, mode_t mode ATTRIBUTE_U
 		goto _error;
 	}
 	xfd->fileno = fd;
-	insert_fd(xfd);
+	result = insert_fd(xfd);
+	if (result < 0)
+		goto _error;
 	return fd;
 
  _error:
@@ -609,79 +1312,790 @@ static int oss_dsp_open(int card, int device, int oflag, mode_t mode ATTRIBUTE_U
 			snd_pcm_close(dsp->streams[k].pcm);
 		if (dsp->streams[k].sw_params)
 			snd_pcm_sw_params_free(dsp->streams[k].sw_params);
+		free(dsp->streams[k].pollfds);
+		free(dsp->streams[k].iov_buf);
+		free(dsp->streams[k].carry);
+		free(dsp->streams[k].coal_buf);
+		oss_dsp_conv_free(&dsp->streams[k]);
 	}
 	close(fd);
-	if (xfd->dsp)
+	if (xfd->dsp) {
+		pthread_cond_destroy(&xfd->dsp->idle);
+		pthread_mutex_destroy(&xfd->dsp->mutex);
 		free(xfd->dsp);
+	}
 	free(xfd);
 	errno = -result;
 	return -1;
 }
 
-static int xrun(snd_pcm_t *pcm)
+static void recovery_done(recovery_stats_t *st, long long since)
+{
+	long long t = now_us() - since;
+
+	st->count++;
+	st->last = since;
+	st->last_us = t;
+	st->total_us += t;
+	if (t > st->max_us)
+		st->max_us = t;
+}
+
+/*
+ * A recovery is timed from when the stream stopped until data moves
+ * again, not just the prepare or resume call: the start is the trigger
+ * timestamp of the status, the end the next transfer, start or running
+ * pointer update, see recovery_check().  The trigger stamp follows the
+ * pcm tstamp_type, CLOCK_REALTIME unless the configuration picked
+ * another, so the clock it fits is looked for: the time elapsed since
+ * cannot exceed the monotonic uptime.  Falls back to now.
+ */
+static long long stream_stopped_at(snd_pcm_t *pcm)
+{
+	static const clockid_t clocks[] = {
+		CLOCK_REALTIME, CLOCK_MONOTONIC, CLOCK_MONOTONIC_RAW
+	};
+	snd_pcm_status_t *status;
+	snd_htimestamp_t trigger;
+	long long now = now_us(), t;
+	unsigned int k;
+
+	snd_pcm_status_alloca(&status);
+	if (snd_pcm_status(pcm, status) < 0)
+		return now;
+	snd_pcm_status_get_trigger_htstamp(status, &trigger);
+	t = trigger.tv_sec * 1000000LL + trigger.tv_nsec / 1000;
+	if (!t)
+		return now;
+	for (k = 0; k < sizeof(clocks) / sizeof(clocks[0]); k++) {
+		struct timespec ts;
+		long long elapsed;
+
+		if (clock_gettime(clocks[k], &ts) < 0)
+			continue;
+		elapsed = ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 - t;
+		if (elapsed >= 0 && elapsed <= now)
+			return now - elapsed;
+	}
+	return now;
+}
+
+static void recovery_check(oss_dsp_stream_t *str)
+{
+	if (str->xrun_since) {
+		recovery_done(&str->stats.xruns, str->xrun_since);
+		str->xrun_since = 0;
+		DEBUG("xrun recovered in %lld us\n", str->stats.xruns.last_us);
+	}
+	if (str->suspend_since) {
+		recovery_done(&str->stats.resumes, str->suspend_since);
+		str->suspend_since = 0;
+		DEBUG("resumed in %lld us\n", str->stats.resumes.last_us);
+	}
+}
+
+static int xrun(oss_dsp_t *dsp ATTRIBUTE_UNUSED, oss_dsp_stream_t *str)
 {
+	snd_pcm_t *pcm = str->pcm;
+
 	switch (snd_pcm_state(pcm)) {
 	case SND_PCM_STATE_XRUN:
-		return snd_pcm_prepare(pcm);
+		break;
 	case SND_PCM_STATE_DRAINING:
 		if (snd_pcm_stream(pcm) == SND_PCM_STREAM_CAPTURE)
-			return snd_pcm_prepare(pcm);
-		break;
+			break;
+		return -EIO;
 	default:
-		break;
+		return -EIO;
 	}
-	return -EIO;
+	if (!str->xrun_since)
+		str->xrun_since = stream_stopped_at(pcm);
+	return snd_pcm_prepare(pcm);
 }
 
-static int resume(snd_pcm_t *pcm)
+/*
+ * snd_pcm_resume() is tried once per call, -EAGAIN goes back to the
+ * caller and blocking ones retry from oss_dsp_wait() with an exponential
+ * backoff capped at RESUME_DELAY_MAX.  A stream still not back after
+ * RESUME_TIMEOUT is prepared again, which drops what was queued but
+ * bounds the wait.
+ */
+#define RESUME_DELAY_MIN	250		/* us */
+#define RESUME_DELAY_MAX	4000
+#define RESUME_TIMEOUT		100000
+
+static int resume(oss_dsp_t *dsp ATTRIBUTE_UNUSED, oss_dsp_stream_t *str)
 {
+	snd_pcm_t *pcm = str->pcm;
 	int res;
-	while ((res = snd_pcm_resume(pcm)) == -EAGAIN)
-		sleep(1);
-	if (! res)
-		return 0;
-	return snd_pcm_prepare(pcm);
+
+	if (!str->resume_since) {
+		str->resume_since = now_us();
+		if (!str->suspend_since)
+			str->suspend_since = stream_stopped_at(pcm);
+	}
+	res = snd_pcm_resume(pcm);
+	if (res == -EAGAIN && now_us() - str->resume_since < RESUME_TIMEOUT)
+		return -EAGAIN;
+	if (res)
+		res = snd_pcm_prepare(pcm);
+	str->resume_since = 0;
+	str->resume_delay = 0;
+	return res;
 }
 
-ssize_t lib_oss_pcm_write(int fd, const void *buf, size_t n)
+/*
+ * The pcm is always non-blocking: a blocking fd waits for the device
+ * here, between two attempts, without the dsp mutex and outside the fd
+ * table section.  Other threads keep polling, querying, reading while
+ * writing and closing meanwhile, and retired fds get freed.  users keeps
+ * the dsp itself alive until close has seen every waiter come back.
+ * The pcm may thus be in snd_pcm_wait() in one thread while another one
+ * calls into it, which relies on alsa-lib's own per pcm locking.
+ * Returns -EBADF if the fd was closed meanwhile.
+ */
+#define WAIT_SLICE		100		/* ms */
+
+static void oss_dsp_release(oss_dsp_t *dsp)
 {
-	ssize_t result;
-	oss_dsp_t *dsp = look_for_dsp(fd);
-	oss_dsp_stream_t *str;
-	snd_pcm_t *pcm;
-	snd_pcm_uframes_t frames;
+	dsp->users++;
+	pthread_mutex_unlock(&dsp->mutex);
+	fd_table_leave(&pcm_fds);
+}
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		result = -1;
-		goto _end;
-	}
-	str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
-	pcm = str->pcm;
-	if (!pcm) {
-		errno = EBADFD;
-		result = -1;
-		goto _end;
-	}
-	frames = n / str->frame_bytes;
- _again:
-	result = snd_pcm_writei(pcm, buf, frames);
-	if (result == -EPIPE) {
-		if (! (result = xrun(pcm)))
-			goto _again;
-	} else if (result == -ESTRPIPE) {
-		if (! (result = resume(pcm)))
-			goto _again;
+static void oss_dsp_reacquire(oss_dsp_t *dsp)
+{
+	fd_table_enter(&pcm_fds);
+	pthread_mutex_lock(&dsp->mutex);
+	if (!--dsp->users)
+		pthread_cond_broadcast(&dsp->idle);
+}
+
+static int oss_dsp_wait(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	snd_pcm_t *pcm = str->pcm;
+	int closing = dsp->closed;
+	long long us = 0;
+	snd_pcm_sframes_t delay;
+
+	switch (snd_pcm_state(pcm)) {
+	case SND_PCM_STATE_SUSPENDED:
+		/* no descriptor tells when resuming would work */
+		us = str->resume_delay ? str->resume_delay : RESUME_DELAY_MIN;
+		str->resume_delay = us * 2 < RESUME_DELAY_MAX ? us * 2 : RESUME_DELAY_MAX;
+		break;
+	case SND_PCM_STATE_DRAINING:
+		/* playback polls ready as soon as there is room, not at the end */
+		if (snd_pcm_stream(pcm) != SND_PCM_STREAM_PLAYBACK)
+			break;
+		if (snd_pcm_delay(pcm, &delay) < 0 || delay < 0)
+			delay = 0;
+		us = (long long)delay * 1000000 / str->hw_rate;
+		if (us < 1000)
+			us = 1000;
+		else if (us > WAIT_SLICE * 1000)
+			us = WAIT_SLICE * 1000;
+		break;
+	default:
+		break;
+	}
+	oss_dsp_release(dsp);
+	if (us)
+		usleep(us);
+	else
+		snd_pcm_wait(pcm, WAIT_SLICE);
+	oss_dsp_reacquire(dsp);
+	if (dsp->closed && !closing)
+		return -EBADF;
+	return 0;
+}
+
+/* one transfer or drain per stream at a time, they would share its buffers */
+static int oss_dsp_claim(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	while (str->busy && !dsp->closed) {
+		dsp->users++;
+		fd_table_leave(&pcm_fds);
+		pthread_cond_wait(&dsp->idle, &dsp->mutex);
+		fd_table_enter(&pcm_fds);
+		if (!--dsp->users)
+			pthread_cond_broadcast(&dsp->idle);
+	}
+	if (dsp->closed)
+		return -EBADF;
+	str->busy = 1;
+	return 0;
+}
+
+static void oss_dsp_unclaim(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	str->busy = 0;
+	pthread_cond_broadcast(&dsp->idle);
+}
+
+static snd_pcm_sframes_t pcm_writei(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+				    const void *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t result;
+ _again:
+	result = snd_pcm_writei(str->pcm, buf, frames);
+	if (result > 0) {
+		recovery_check(str);
+	} else if (result == -EPIPE) {
+		if (! (result = xrun(dsp, str)))
+			goto _again;
+	} else if (result == -ESTRPIPE) {
+		if (! (result = resume(dsp, str)))
+			goto _again;
+	}
+	return result;
+}
+
+/*
+ * snd_pcm_writei() for an MMAP_INTERLEAVED stream in the OSS format: the
+ * frames are copied straight into the ring, which is one copy and, with
+ * a mapped status page, no ioctl less than the RW transfer.
+ */
+static snd_pcm_sframes_t mmap_writei(oss_dsp_t *dsp ATTRIBUTE_UNUSED,
+				     oss_dsp_stream_t *str,
+				     const void *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_t *pcm = str->pcm;
+	snd_pcm_uframes_t done = 0;
+	snd_pcm_sframes_t err = 0;
+
+	while (done < frames) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t ofs, n;
+		snd_pcm_sframes_t avail;
+		snd_pcm_state_t state = snd_pcm_state(pcm);
+
+		switch (state) {
+		case SND_PCM_STATE_PREPARED:
+		case SND_PCM_STATE_RUNNING:
+			break;
+		case SND_PCM_STATE_XRUN:
+			err = -EPIPE;
+			goto _end;
+		case SND_PCM_STATE_SUSPENDED:
+			err = -ESTRPIPE;
+			goto _end;
+		default:
+			err = -EBADFD;
+			goto _end;
+		}
+		avail = snd_pcm_avail_update(pcm);
+		if (avail < 0) {
+			err = avail;
+			goto _end;
+		}
+		if (avail == 0) {
+			if (state == SND_PCM_STATE_PREPARED && !str->stopped) {
+				/* full but below the start threshold */
+				err = snd_pcm_start(pcm);
+				if (err < 0)
+					goto _end;
+				continue;
+			}
+			/* waiting is up to the caller, see oss_dsp_wait() */
+			err = -EAGAIN;
+			goto _end;
+		}
+		n = frames - done;
+		if (n > (snd_pcm_uframes_t)avail)
+			n = avail;
+		err = snd_pcm_mmap_begin(pcm, &areas, &ofs, &n);
+		if (err < 0)
+			goto _end;
+		/* MMAP_INTERLEAVED: channel 0 area covers whole frames */
+		memcpy((char *)areas[0].addr + (areas[0].first + ofs * areas[0].step) / 8,
+		       (const char *)buf + done * str->frame_bytes, n * str->frame_bytes);
+		err = snd_pcm_mmap_commit(pcm, ofs, n);
+		if (err < 0)
+			goto _end;
+		done += err;
+		if (state == SND_PCM_STATE_PREPARED && !str->stopped &&
+		    str->alsa.buffer_size - (avail - err) >= str->alsa.period_size) {
+			err = snd_pcm_start(pcm);
+			if (err < 0)
+				goto _end;
+		}
+	}
+ _end:
+	if (err < 0 && !done)
+		return err;
+	return done;
+}
+
+static snd_pcm_sframes_t pcm_mmap_writei(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					 const void *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t result;
+ _again:
+	result = mmap_writei(dsp, str, buf, frames);
+	if (result > 0) {
+		recovery_check(str);
+	} else if (result == -EPIPE) {
+		if (! (result = xrun(dsp, str)))
+			goto _again;
+	} else if (result == -ESTRPIPE) {
+		if (! (result = resume(dsp, str)))
+			goto _again;
+	}
+	return result;
+}
+
+static snd_pcm_sframes_t pcm_readi(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+				   void *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t result;
+ _again:
+	result = snd_pcm_readi(str->pcm, buf, frames);
+	if (result > 0) {
+		recovery_check(str);
+	} else if (result == -EPIPE) {
+		if (! (result = xrun(dsp, str)))
+			goto _again;
+	} else if (result == -ESTRPIPE) {
+		if (! (result = resume(dsp, str)))
+			goto _again;
+	}
+	return result;
+}
+
+/*
+ * Converting transfers go through conv_buf one chunk at a time.  Common
+ * pairs have a direct (vectorized) kernel, the others are decoded to s32
+ * and encoded again in place.  A short transfer ends the loop, what was
+ * done so far is reported.
+ */
+static snd_pcm_sframes_t oss_dsp_writei_conv(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					     const void *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t done = 0;
+
+	while (done < frames) {
+		snd_pcm_uframes_t chunk = frames - done;
+		snd_pcm_sframes_t result;
+		const void *src;
+		if (chunk > str->conv_frames)
+			chunk = str->conv_frames;
+		src = (const char *)buf + done * str->frame_bytes;
+		if (alsa_oss_convert_direct(str->conv_buf, str->hw_format, src, dsp->format,
+					    chunk * dsp->channels) < 0) {
+			alsa_oss_convert_to_s32(str->conv_buf, src, chunk * dsp->channels,
+						dsp->format);
+			alsa_oss_convert_from_s32(str->conv_buf, str->conv_buf,
+						  chunk * dsp->channels, str->hw_format);
+		}
+		result = pcm_writei(dsp, str, str->conv_buf, chunk);
+		if (result < 0)
+			return done ? (snd_pcm_sframes_t)done : result;
+		done += result;
+		if ((snd_pcm_uframes_t)result < chunk)
+			break;
+	}
+	return done;
+}
+
+static snd_pcm_sframes_t oss_dsp_readi_conv(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					    void *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t done = 0;
+
+	while (done < frames) {
+		snd_pcm_uframes_t chunk = frames - done;
+		snd_pcm_sframes_t result;
+		void *dst;
+		if (chunk > str->conv_frames)
+			chunk = str->conv_frames;
+		result = pcm_readi(dsp, str, str->conv_buf, chunk);
+		if (result < 0)
+			return done ? (snd_pcm_sframes_t)done : result;
+		dst = (char *)buf + done * str->frame_bytes;
+		if (alsa_oss_convert_direct(dst, dsp->format, str->conv_buf, str->hw_format,
+					    result * dsp->channels) < 0) {
+			alsa_oss_convert_to_s32(str->conv_buf, str->conv_buf,
+						result * dsp->channels, str->hw_format);
+			alsa_oss_convert_from_s32(dst, str->conv_buf,
+						  result * dsp->channels, dsp->format);
+		}
+		done += result;
+		if ((snd_pcm_uframes_t)result < chunk)
+			break;
+	}
+	return done;
+}
+
+/* hands the resampled frames a short write left behind to the device */
+static snd_pcm_sframes_t oss_dsp_rs_flush(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	size_t bytes = snd_pcm_format_physical_width(str->hw_format) * dsp->channels / 8;
+	snd_pcm_uframes_t done = 0;
+
+	while (str->rs_count) {
+		snd_pcm_sframes_t result;
+		result = pcm_writei(dsp, str, (char *)str->rs_buf + str->rs_head * bytes,
+				    str->rs_count);
+		if (result < 0)
+			return done ? (snd_pcm_sframes_t)done : result;
+		if (result == 0)
+			break;
+		str->rs_head += result;
+		str->rs_count -= result;
+		done += result;
+	}
+	return done;
+}
+
+/*
+ * Resampling transfers report OSS frames and count the device frames
+ * moved in *hw_frames.  A chunk is resampled as a whole; whatever the
+ * device does not take right away stays in rs_buf (playback, already in
+ * the device format) or is kept for the next read (capture, as s32).
+ */
+static snd_pcm_sframes_t oss_dsp_writei_rs(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					   const void *buf, snd_pcm_uframes_t frames,
+					   snd_pcm_uframes_t *hw_frames)
+{
+	snd_pcm_uframes_t done = 0;
+
+	*hw_frames = 0;
+	for (;;) {
+		snd_pcm_uframes_t chunk;
+		snd_pcm_sframes_t result = oss_dsp_rs_flush(dsp, str);
+		if (result > 0)
+			*hw_frames += result;
+		if (str->rs_count) {
+			if (result < 0 && !done)
+				return result;
+			break;
+		}
+		if (done == frames)
+			break;
+		chunk = frames - done;
+		if (chunk > str->conv_frames)
+			chunk = str->conv_frames;
+		alsa_oss_convert_to_s32(str->conv_buf, (const char *)buf + done * str->frame_bytes,
+					chunk * dsp->channels, dsp->format);
+		str->rs_count = alsa_oss_resampler_process(str->rs, str->rs_buf,
+							   str->conv_buf, chunk);
+		str->rs_head = 0;
+		alsa_oss_convert_from_s32(str->rs_buf, str->rs_buf,
+					  str->rs_count * dsp->channels, str->hw_format);
+		done += chunk;
+	}
+	return done;
+}
+
+static snd_pcm_sframes_t oss_dsp_readi_rs(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					  void *buf, snd_pcm_uframes_t frames,
+					  snd_pcm_uframes_t *hw_frames)
+{
+	snd_pcm_uframes_t done = 0;
+
+	*hw_frames = 0;
+	while (done < frames) {
+		snd_pcm_uframes_t n;
+		if (!str->rs_count) {
+			snd_pcm_sframes_t result;
+			n = alsa_oss_resampler_need(str->rs, frames - done);
+			if (n > str->conv_frames)
+				n = str->conv_frames;
+			if (n == 0)
+				n = 1;
+			result = pcm_readi(dsp, str, str->conv_buf, n);
+			if (result < 0)
+				return done ? (snd_pcm_sframes_t)done : result;
+			if (result == 0)
+				break;
+			*hw_frames += result;
+			alsa_oss_convert_to_s32(str->conv_buf, str->conv_buf,
+						result * dsp->channels, str->hw_format);
+			str->rs_count = alsa_oss_resampler_process(str->rs, str->rs_buf,
+								   str->conv_buf, result);
+			str->rs_head = 0;
+			continue;
+		}
+		n = frames - done;
+		if (n > str->rs_count)
+			n = str->rs_count;
+		alsa_oss_convert_from_s32((char *)buf + done * str->frame_bytes,
+					  str->rs_buf + str->rs_head * dsp->channels,
+					  n * dsp->channels, dsp->format);
+		str->rs_head += n;
+		str->rs_count -= n;
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * In silence fill mode a starved stream keeps running and the hardware
+ * pointer overtakes ours.  Skip what was played as silence, so that new
+ * data is queued right behind it and not into the past.
+ */
+static void oss_dsp_catch_up(oss_dsp_stream_t *str)
+{
+	snd_pcm_sframes_t avail = snd_pcm_avail_update(str->pcm), n;
+
+	if (avail <= (snd_pcm_sframes_t)str->alsa.buffer_size)
+		return;
+	n = snd_pcm_forward(str->pcm, avail - str->alsa.buffer_size);
+	if (n <= 0)
+		return;
+	str->alsa.appl_ptr += n;
+	str->alsa.appl_ptr %= str->alsa.boundary;
+	str->silence_skipped += n;
+	str->stats.starved++;
+	str->stats.starved_frames += n;
+}
+
+/* whole frames, returns the frames done or a negative error */
+static snd_pcm_sframes_t oss_dsp_writei(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					const void *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t result;
+	snd_pcm_uframes_t hw_frames;
+
+	if (str->silence_fill)
+		oss_dsp_catch_up(str);
+
+	if (str->rs)
+		result = oss_dsp_writei_rs(dsp, str, buf, frames, &hw_frames);
+	else {
+		if (str->conv_buf)
+			result = oss_dsp_writei_conv(dsp, str, buf, frames);
+		else if (str->mmap_write)
+			result = pcm_mmap_writei(dsp, str, buf, frames);
+		else
+			result = pcm_writei(dsp, str, buf, frames);
+		hw_frames = result > 0 ? result : 0;
+	}
+	str->alsa.appl_ptr += hw_frames;
+	str->alsa.appl_ptr %= str->alsa.boundary;
+	if (result > 0)
+		str->oss.bytes += result * str->frame_bytes;
+	return result;
+}
+
+static snd_pcm_sframes_t oss_dsp_readi(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+				       void *buf, snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t result;
+	snd_pcm_uframes_t hw_frames;
+
+	if (str->rs)
+		result = oss_dsp_readi_rs(dsp, str, buf, frames, &hw_frames);
+	else {
+		if (str->conv_buf)
+			result = oss_dsp_readi_conv(dsp, str, buf, frames);
+		else
+			result = pcm_readi(dsp, str, buf, frames);
+		hw_frames = result > 0 ? result : 0;
+	}
+	str->alsa.appl_ptr += hw_frames;
+	str->alsa.appl_ptr %= str->alsa.boundary;
+	if (result > 0)
+		str->oss.bytes += result * str->frame_bytes;
+	return result;
+}
+
+/*
+ * A write ending inside a frame leaves the rest in carry, completed and
+ * played by the next one; a read ending inside a frame keeps the rest of
+ * that frame in carry for the next one.  Either way the stream stays
+ * sample exact whatever sizes the application uses.
+ */
+static ssize_t oss_dsp_put(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+			   const void *buf, size_t n)
+{
+	snd_pcm_sframes_t frames;
+	const char *p = buf;
+	size_t done = 0;
+
+	if (str->carry_bytes) {
+		size_t fill = str->frame_bytes - str->carry_bytes;
+		if (fill > n)
+			fill = n;
+		memcpy(str->carry + str->carry_bytes, p, fill);
+		if (str->carry_bytes + fill < str->frame_bytes) {
+			str->carry_bytes += fill;
+			return n;
+		}
+		frames = oss_dsp_writei(dsp, str, str->carry, 1);
+		if (frames <= 0)
+			return frames;
+		str->carry_bytes = 0;
+		done = fill;
+	}
+	if (n - done >= str->frame_bytes) {
+		frames = oss_dsp_writei(dsp, str, p + done, (n - done) / str->frame_bytes);
+		if (frames < 0)
+			return done ? (ssize_t)done : frames;
+		done += frames * str->frame_bytes;
+	}
+	if (n - done < str->frame_bytes) {
+		str->carry_bytes = n - done;
+		memcpy(str->carry, p + done, str->carry_bytes);
+		done = n;
+	}
+	return done;
+}
+
+/*
+ * With ALSA_OSS_COALESCE small writes are staged in coal_buf, up to the
+ * given percentage of a period, and go to the device in one transfer
+ * once the next write does not fit, or when something needs to know
+ * where the stream stands.  Returns 0 once everything staged is gone.
+ */
+static int oss_dsp_coal_flush(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	while (str->coal_bytes) {
+		ssize_t result = oss_dsp_put(dsp, str, str->coal_buf + str->coal_head,
+					     str->coal_bytes);
+		if (result < 0)
+			return result;
+		if (result == 0)
+			return -EAGAIN;
+		str->coal_head += result;
+		str->coal_bytes -= result;
+	}
+	if (str->coal_head) {
+		str->coal_head = 0;
+		str->stats.coal_flushes++;
+	}
+	return 0;
+}
+
+/*
+ * The queries only hand the device what avail_update() says it has room
+ * for and never wait.  Returns the frames still staged, which they add
+ * to the delay and take from the free space themselves.
+ */
+static snd_pcm_uframes_t oss_dsp_coal_push(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	snd_pcm_sframes_t avail;
+	ssize_t result;
+	size_t n;
+
+	if (!str->coal_bytes)
+		return 0;
+	avail = snd_pcm_avail_update(str->pcm);
+	if (avail > (snd_pcm_sframes_t)str->rs_count) {
+		n = oss_frames(dsp, str, avail - str->rs_count) * str->frame_bytes;
+		if (n > str->coal_bytes)
+			n = str->coal_bytes;
+		result = n ? oss_dsp_put(dsp, str, str->coal_buf + str->coal_head, n) : 0;
+		if (result > 0) {
+			str->coal_head += result;
+			str->coal_bytes -= result;
+		}
+		if (!str->coal_bytes) {
+			str->coal_head = 0;
+			str->stats.coal_flushes++;
+		}
+	}
+	return str->coal_bytes / str->frame_bytes;
+}
+
+static ssize_t oss_dsp_put_coalesced(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+				     const void *buf, size_t n)
+{
+	int err;
+
+	if (n >= str->coal_limit) {
+		err = oss_dsp_coal_flush(dsp, str);
+		if (err < 0)
+			return err;
+		return oss_dsp_put(dsp, str, buf, n);
+	}
+	if (str->coal_head + str->coal_bytes + n > str->coal_limit) {
+		err = oss_dsp_coal_flush(dsp, str);
+		if (err < 0)
+			return err;
+	}
+	memcpy(str->coal_buf + str->coal_head + str->coal_bytes, buf, n);
+	str->coal_bytes += n;
+	str->stats.coal_writes++;
+	return n;
+}
+
+/* gets what is staged to the device, waiting for room on blocking fds */
+static int oss_dsp_flush(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	snd_pcm_sframes_t res;
+	int err;
+
+	for (;;) {
+		err = oss_dsp_coal_flush(dsp, str);
+		if (!err) {
+			res = oss_dsp_rs_flush(dsp, str);
+			err = res < 0 ? (int)res : str->rs_count ? -EAGAIN : 0;
+		}
+		if (err != -EAGAIN || dsp->nonblock)
+			return err;
+		err = oss_dsp_wait(dsp, str);
+		if (err < 0)
+			return err;
+	}
+}
+
+/*
+ * Blocking fds go on until the whole count is through, the others stop
+ * at the first attempt the device has no room for.  Both return what
+ * was done if anything was.
+ */
+static ssize_t oss_dsp_put_all(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+			       const void *buf, size_t n)
+{
+	const char *p = buf;
+	ssize_t result;
+	size_t done = 0;
+
+	if (dsp->rt && !dsp->rt_done)
+		oss_dsp_rt_promote(dsp);
+	for (;;) {
+		if (str->coal_limit)
+			result = oss_dsp_put_coalesced(dsp, str, p + done, n - done);
+		else
+			result = oss_dsp_put(dsp, str, p + done, n - done);
+		if (result > 0)
+			done += result;
+		else if (result < 0 && result != -EAGAIN)
+			break;
+		if (done == n)
+			break;
+		result = -EAGAIN;
+		if (dsp->nonblock)
+			break;
+		result = oss_dsp_wait(dsp, str);
+		if (result < 0)
+			break;
+	}
+	return done ? (ssize_t)done : result;
+}
+
+static ssize_t oss_dsp_write(oss_dsp_t *dsp, int fd, const void *buf, size_t n)
+{
+	ssize_t result;
+	oss_dsp_stream_t *str;
+
+	str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
+	if (!str->pcm) {
+		errno = EBADFD;
+		result = -1;
+		goto _end;
+	}
+	result = oss_dsp_claim(dsp, str);
+	if (result >= 0) {
+		result = oss_dsp_put_all(dsp, str, buf, n);
+		oss_dsp_unclaim(dsp, str);
 	}
 	if (result < 0) {
 		errno = -result;
 		result = -1;
-		goto _end;
 	}
-	str->alsa.appl_ptr += result;
-	str->alsa.appl_ptr %= str->alsa.boundary;
-	result *= str->frame_bytes;
-	str->oss.bytes += result;
  _end:
 	DEBUG("write(%d, %p, %ld) -> %ld", fd, buf, (long)n, (long)result);
 	if (result < 0)
@@ -691,55 +2105,421 @@ ssize_t lib_oss_pcm_write(int fd, const void *buf, size_t n)
 	return result;
 }
 
-ssize_t lib_oss_pcm_read(int fd, void *buf, size_t n)
+static ssize_t oss_dsp_get(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+			   void *buf, size_t n)
+{
+	snd_pcm_sframes_t frames;
+	char *p = buf;
+	size_t done = 0;
+
+	if (str->carry_bytes) {
+		done = str->carry_bytes < n ? str->carry_bytes : n;
+		memcpy(p, str->carry + str->carry_ofs, done);
+		str->carry_ofs += done;
+		str->carry_bytes -= done;
+	}
+	if (n - done >= str->frame_bytes) {
+		snd_pcm_uframes_t want = (n - done) / str->frame_bytes;
+		frames = oss_dsp_readi(dsp, str, p + done, want);
+		if (frames < 0)
+			return done ? (ssize_t)done : frames;
+		done += frames * str->frame_bytes;
+		if ((snd_pcm_uframes_t)frames < want)
+			return done;
+	}
+	if (done < n) {
+		frames = oss_dsp_readi(dsp, str, str->carry, 1);
+		if (frames == 1) {
+			memcpy(p + done, str->carry, n - done);
+			str->carry_ofs = n - done;
+			str->carry_bytes = str->frame_bytes - (n - done);
+			done = n;
+		} else if (frames < 0 && !done)
+			return frames;
+	}
+	return done;
+}
+
+/* as oss_dsp_put_all() */
+static ssize_t oss_dsp_get_all(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+			       void *buf, size_t n)
+{
+	char *p = buf;
+	ssize_t result;
+	size_t done = 0;
+
+	for (;;) {
+		result = oss_dsp_get(dsp, str, p + done, n - done);
+		if (result > 0)
+			done += result;
+		else if (result < 0 && result != -EAGAIN)
+			break;
+		if (done == n)
+			break;
+		result = -EAGAIN;
+		if (dsp->nonblock)
+			break;
+		result = oss_dsp_wait(dsp, str);
+		if (result < 0)
+			break;
+	}
+	return done ? (ssize_t)done : result;
+}
+
+static ssize_t oss_dsp_read(oss_dsp_t *dsp, int fd, void *buf, size_t n)
+{
+	ssize_t result;
+	oss_dsp_stream_t *str;
+
+	str = &dsp->streams[SND_PCM_STREAM_CAPTURE];
+	if (!str->pcm) {
+		errno = EBADFD;
+		result = -1;
+		goto _end;
+	}
+	result = oss_dsp_claim(dsp, str);
+	if (result >= 0) {
+		result = oss_dsp_get_all(dsp, str, buf, n);
+		oss_dsp_unclaim(dsp, str);
+	}
+	if (result < 0) {
+		errno = -result;
+		result = -1;
+	}
+ _end:
+	DEBUG("read(%d, %p, %ld) -> %ld", fd, buf, (long)n, (long)result);
+	if (result < 0)
+		DEBUG("(errno=%d)\n", errno);
+	else
+		DEBUG("\n");
+	return result;
+}
+
+/*
+ * readv()/writev() are a single transfer, the stream stays claimed.  Iovecs
+ * which are back to back in memory go straight through, others are
+ * gathered into (scattered from) iov_buf a device buffer at a time, which
+ * also takes care of frames split across iovecs.
+ */
+static ssize_t iov_total(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+	int k;
+
+	if (iovcnt < 0 || iovcnt > IOV_MAX)
+		return -EINVAL;
+	for (k = 0; k < iovcnt; k++) {
+		if (iov[k].iov_len > (size_t)SSIZE_MAX - total)
+			return -EINVAL;
+		total += iov[k].iov_len;
+	}
+	return total;
+}
+
+/* start of the iovecs if they are contiguous, NULL otherwise */
+static char *iov_contiguous(const struct iovec *iov, int iovcnt)
+{
+	char *base = NULL, *end = NULL;
+	int k;
+
+	for (k = 0; k < iovcnt; k++) {
+		if (!iov[k].iov_len)
+			continue;
+		if (!base)
+			base = end = iov[k].iov_base;
+		else if (iov[k].iov_base != end)
+			return NULL;
+		end += iov[k].iov_len;
+	}
+	return base;
+}
+
+/* returns the usable size in whole frames, 0 on failure */
+static size_t oss_dsp_iov_buf(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	size_t bytes = str->oss.buffer_size * str->frame_bytes;
+
+	if (bytes < 4096)
+		bytes = 4096;
+	if (bytes > str->iov_bytes) {
+		char *buf;
+		if (str->nlocked)
+			oss_dsp_unlock_buffers(str);
+		buf = realloc(str->iov_buf, bytes);
+		if (!buf)
+			return 0;
+		str->iov_buf = buf;
+		str->iov_bytes = bytes;
+		if (dsp->rt_done)
+			oss_dsp_lock_buffers(dsp, str);
+	}
+	return str->iov_bytes - str->iov_bytes % str->frame_bytes;
+}
+
+static ssize_t oss_dsp_writev(oss_dsp_t *dsp, int fd, const struct iovec *iov, int iovcnt)
+{
+	oss_dsp_stream_t *str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
+	ssize_t total, result, done = 0;
+	size_t cap, ofs = 0;
+	char *base;
+	int k = 0;
+
+	total = iov_total(iov, iovcnt);
+	if (total < 0) {
+		errno = -total;
+		return -1;
+	}
+	base = iov_contiguous(iov, iovcnt);
+	if (base || !total || !str->pcm)
+		return oss_dsp_write(dsp, fd, base, total);
+	result = oss_dsp_claim(dsp, str);
+	if (result < 0) {
+		errno = -result;
+		return -1;
+	}
+	cap = oss_dsp_iov_buf(dsp, str);
+	if (!cap) {
+		oss_dsp_unclaim(dsp, str);
+		errno = ENOMEM;
+		return -1;
+	}
+	while (done < total) {
+		size_t chunk = total - done, n = 0;
+		if (chunk > cap)
+			chunk = cap;
+		while (n < chunk) {
+			size_t len = iov[k].iov_len - ofs;
+			if (len > chunk - n)
+				len = chunk - n;
+			memcpy(str->iov_buf + n, (char *)iov[k].iov_base + ofs, len);
+			n += len;
+			ofs += len;
+			if (ofs == iov[k].iov_len) {
+				k++;
+				ofs = 0;
+			}
+		}
+		result = oss_dsp_put_all(dsp, str, str->iov_buf, chunk);
+		if (result < 0) {
+			if (!done) {
+				errno = -result;
+				done = -1;
+			}
+			break;
+		}
+		done += result;
+		if ((size_t)result < chunk)
+			break;
+	}
+	oss_dsp_unclaim(dsp, str);
+	return done;
+}
+
+static ssize_t oss_dsp_readv(oss_dsp_t *dsp, int fd, const struct iovec *iov, int iovcnt)
+{
+	oss_dsp_stream_t *str = &dsp->streams[SND_PCM_STREAM_CAPTURE];
+	ssize_t total, result, done = 0;
+	size_t cap, ofs = 0;
+	char *base;
+	int k = 0;
+
+	total = iov_total(iov, iovcnt);
+	if (total < 0) {
+		errno = -total;
+		return -1;
+	}
+	base = iov_contiguous(iov, iovcnt);
+	if (base || !total || !str->pcm)
+		return oss_dsp_read(dsp, fd, base, total);
+	result = oss_dsp_claim(dsp, str);
+	if (result < 0) {
+		errno = -result;
+		return -1;
+	}
+	cap = oss_dsp_iov_buf(dsp, str);
+	if (!cap) {
+		oss_dsp_unclaim(dsp, str);
+		errno = ENOMEM;
+		return -1;
+	}
+	while (done < total) {
+		size_t chunk = total - done, n = 0;
+		if (chunk > cap)
+			chunk = cap;
+		result = oss_dsp_get_all(dsp, str, str->iov_buf, chunk);
+		if (result < 0) {
+			if (!done) {
+				errno = -result;
+				done = -1;
+			}
+			break;
+		}
+		while (n < (size_t)result) {
+			size_t len = iov[k].iov_len - ofs;
+			if (len > result - n)
+				len = result - n;
+			memcpy((char *)iov[k].iov_base + ofs, str->iov_buf + n, len);
+			n += len;
+			ofs += len;
+			if (ofs == iov[k].iov_len) {
+				k++;
+				ofs = 0;
+			}
+		}
+		done += result;
+		if ((size_t)result < chunk)
+			break;
+	}
+	oss_dsp_unclaim(dsp, str);
+	return done;
+}
+
+#define USE_REWIND 1
+
+/*
+ * mmap_advance, how far ahead of the device the shadow buffer is copied,
+ * grows by whatever an update found playback behind.  After each
+ * 60 / ALSA_OSS_MMAP_XRUNS seconds without that happening, half of what
+ * it has above a period is given back: one hiccup no longer raises the
+ * latency for good, and it settles around that many underruns a minute.
+ * 0 keeps the advance from ever shrinking.
+ */
+static void oss_dsp_advance_track(oss_dsp_t *dsp, oss_dsp_stream_t *str, int late)
+{
+	snd_pcm_uframes_t floor = str->oss.period_size;
+	long long now = now_us();
+
+	if (late) {
+		str->stats.mmap_late++;
+		str->advance_since = now;
+		DEBUG("mmap_advance raised to %lu\n", (unsigned long)str->mmap_advance);
+	} else if (!str->advance_since) {
+		str->advance_since = now;
+	} else if (dsp->mmap_xruns && str->mmap_advance > floor &&
+		   now - str->advance_since >= 60000000LL / dsp->mmap_xruns) {
+		str->mmap_advance -= (str->mmap_advance - floor + 1) / 2;
+		str->advance_since = now;
+		str->stats.advance_decays++;
+		DEBUG("mmap_advance decayed to %lu\n", (unsigned long)str->mmap_advance);
+	}
+	if (!str->stats.advance_max) {
+		str->stats.advance_min = str->mmap_advance;
+		str->stats.advance_max = str->mmap_advance;
+	} else if (str->mmap_advance < str->stats.advance_min)
+		str->stats.advance_min = str->mmap_advance;
+	else if (str->mmap_advance > str->stats.advance_max)
+		str->stats.advance_max = str->mmap_advance;
+}
+
+/* copies from the shadow buffer at appl_ptr and commits, returns the frames done */
+static snd_pcm_uframes_t oss_dsp_mmap_copy(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+					   snd_pcm_uframes_t size)
 {
-	ssize_t result;
-	oss_dsp_t *dsp = look_for_dsp(fd);
-	oss_dsp_stream_t *str;
-	snd_pcm_t *pcm;
-	snd_pcm_uframes_t frames;
+	snd_pcm_t *pcm = str->pcm;
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t done = 0;
+	snd_pcm_sframes_t err;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		result = -1;
-		goto _end;
-	}
-	str = &dsp->streams[SND_PCM_STREAM_CAPTURE];
-	pcm = str->pcm;
-	if (!pcm) {
-		errno = EBADFD;
-		result = -1;
-		goto _end;
+	if (!str->copy_since)
+		str->copy_since = now_us();
+	while (size > 0) {
+		snd_pcm_uframes_t ofs;
+		snd_pcm_uframes_t frames = size;
+		snd_pcm_mmap_begin(pcm, &areas, &ofs, &frames);
+		if (frames == 0)
+			break;
+//		fprintf(stderr, "copy %ld %ld %d\n", ofs, frames, dsp->format);
+		if (!str->mmap_direct)
+			snd_pcm_areas_copy(areas, ofs, str->mmap_areas,
+					   str->alsa.appl_ptr % str->oss.buffer_size,
+					   dsp->channels, frames,
+					   dsp->format);
+		err = snd_pcm_mmap_commit(pcm, ofs, frames);
+		if (err <= 0)
+			break;
+		size -= err;
+		done += err;
+		str->alsa.appl_ptr += err;
+		str->alsa.appl_ptr %= str->alsa.boundary;
 	}
-	frames = n / str->frame_bytes;
- _again:
-	result = snd_pcm_readi(pcm, buf, frames);
-	if (result == -EPIPE) {
-		if (! (result = xrun(pcm)))
-			goto _again;
-	} else if (result == -ESTRPIPE) {
-		if (! (result = resume(pcm)))
-			goto _again;
+	return done;
+}
+
+static uint64_t mmap_block_hash(oss_dsp_stream_t *str, snd_pcm_uframes_t block)
+{
+	const char *p = (const char *)str->mmap_buffer + block * MMAP_BLOCK * str->frame_bytes;
+	size_t k, n = MMAP_BLOCK * str->frame_bytes / sizeof(uint64_t);
+	uint64_t h = 0, v;
+
+	for (k = 0; k < n; k++, p += sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		h = (h ^ v) * 0x100000001b3ULL;
 	}
-	if (result < 0) {
-		errno = -result;
-		result = -1;
-		goto _end;
+	return h;
+}
+
+/* remembers the blocks overlapping frames [from, from + frames) as copied */
+static void mmap_hash_range(oss_dsp_stream_t *str, snd_pcm_uframes_t from,
+			    snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t blocks = str->oss.buffer_size / MMAP_BLOCK, b, n;
+
+	if (!frames)
+		return;
+	b = (from % str->oss.buffer_size) / MMAP_BLOCK;
+	n = (from % MMAP_BLOCK + frames + MMAP_BLOCK - 1) / MMAP_BLOCK;
+	if (n > blocks)
+		n = blocks;
+	while (n--) {
+		str->mmap_hash[b] = mmap_block_hash(str, b);
+		b = (b + 1) % blocks;
 	}
-	str->alsa.appl_ptr += result;
-	str->alsa.appl_ptr %= str->alsa.boundary;
-	result *= str->frame_bytes;
-	str->oss.bytes += result;
- _end:
-	DEBUG("read(%d, %p, %ld) -> %ld", fd, buf, (long)n, (long)result);
-	if (result < 0)
-		DEBUG("(errno=%d)\n", errno);
-	else
-		DEBUG("\n");
-	return result;
 }
 
-#define USE_REWIND 1
+/*
+ * Delta mode: what is queued stays queued and only the frames coming
+ * inside mmap_advance are copied, each ending on a block boundary.  The
+ * queued blocks are checked against their hash from when they were
+ * copied; if the application rewrote one before it was played, the
+ * device is rewound to that block and the rest copied again.  Without
+ * rewind support the rewritten frames play as first copied.
+ */
+static void oss_dsp_mmap_delta(oss_dsp_t *dsp, oss_dsp_stream_t *str,
+			       snd_pcm_sframes_t delay)
+{
+	snd_pcm_uframes_t queued = delay > 0 ? (snd_pcm_uframes_t)delay : 0;
+	snd_pcm_uframes_t hw, appl, size, d;
+	snd_pcm_sframes_t err;
+
+	if (queued > str->alsa.buffer_size)
+		queued = str->alsa.buffer_size;
+	hw = (str->alsa.appl_ptr + str->alsa.boundary - queued) % str->alsa.boundary;
+	/* the block being played is left alone */
+	for (d = (MMAP_BLOCK - hw % MMAP_BLOCK) % MMAP_BLOCK;
+	     !str->mmap_direct && d + MMAP_BLOCK <= queued; d += MMAP_BLOCK) {
+		snd_pcm_uframes_t b = ((hw + d) % str->oss.buffer_size) / MMAP_BLOCK;
+		if (mmap_block_hash(str, b) == str->mmap_hash[b])
+			continue;
+		err = snd_pcm_rewind(str->pcm, queued - d);
+		if (err > 0) {
+			str->alsa.appl_ptr = (str->alsa.appl_ptr + str->alsa.boundary - err) %
+				str->alsa.boundary;
+			queued -= err;
+			str->stats.mmap_rewinds++;
+		}
+		break;
+	}
+	if (queued >= str->mmap_advance)
+		return;
+	size = str->mmap_advance - queued;
+	appl = str->alsa.appl_ptr;
+	if (size > MMAP_BLOCK)
+		size -= (appl + size) % MMAP_BLOCK;
+	size = oss_dsp_mmap_copy(dsp, str, size);
+	if (!str->mmap_direct)
+		mmap_hash_range(str, appl, size);
+	str->stats.mmap_delta_bytes += size * str->frame_bytes;
+}
 
 static void oss_dsp_mmap_update(oss_dsp_t *dsp, snd_pcm_stream_t stream,
 				snd_pcm_sframes_t delay)
@@ -762,6 +2542,11 @@ static void oss_dsp_mmap_update(oss_dsp_t *dsp, snd_pcm_stream_t stream,
 				str->alsa.appl_ptr %= str->alsa.boundary;
 			}
 		}
+		oss_dsp_advance_track(dsp, str, delay < 0);
+		if (str->mmap_delta) {
+			oss_dsp_mmap_delta(dsp, str, delay);
+			break;
+		}
 #if USE_REWIND
 		err = snd_pcm_rewind(pcm, str->alsa.buffer_size);
 		if (err < 0) {
@@ -776,24 +2561,8 @@ static void oss_dsp_mmap_update(oss_dsp_t *dsp, snd_pcm_stream_t stream,
 #else
 		size = str->mmap_advance - delay;
 #endif
-		while (size > 0) {
-			snd_pcm_uframes_t ofs;
-			snd_pcm_uframes_t frames = size;
-			snd_pcm_mmap_begin(pcm, &areas, &ofs, &frames);
-			if (frames == 0)
-				break;
-//			fprintf(stderr, "copy %ld %ld %d\n", ofs, frames, dsp->format);
-			snd_pcm_areas_copy(areas, ofs, str->mmap_areas,
-					   str->alsa.appl_ptr % str->oss.buffer_size, 
-					   dsp->channels, frames,
-					   dsp->format);
-			err = snd_pcm_mmap_commit(pcm, ofs, frames);
-			if (err <= 0)
-				break;
-			size -= err;
-			str->alsa.appl_ptr += err;
-			str->alsa.appl_ptr %= str->alsa.boundary;
-		}
+		size = oss_dsp_mmap_copy(dsp, str, size);
+		str->stats.mmap_rewind_bytes += size * str->frame_bytes;
 		break;
 	case SND_PCM_STREAM_CAPTURE:
 		if (delay > (snd_pcm_sframes_t)str->alsa.buffer_size) {
@@ -814,11 +2583,12 @@ static void oss_dsp_mmap_update(oss_dsp_t *dsp, snd_pcm_stream_t stream,
 			snd_pcm_mmap_begin(pcm, &areas, &ofs, &frames);
 			if (frames == 0)
 				break;
-			snd_pcm_areas_copy(str->mmap_areas,
-					   str->alsa.appl_ptr % str->oss.buffer_size,
-					   areas, ofs,
-					   dsp->channels, frames,
-					   dsp->format);
+			if (!str->mmap_direct)
+				snd_pcm_areas_copy(str->mmap_areas,
+						   str->alsa.appl_ptr % str->oss.buffer_size,
+						   areas, ofs,
+						   dsp->channels, frames,
+						   dsp->format);
 			err = snd_pcm_mmap_commit(pcm, ofs, frames);
 			if (err < 0)
 				break;
@@ -830,23 +2600,294 @@ static void oss_dsp_mmap_update(oss_dsp_t *dsp, snd_pcm_stream_t stream,
 	}
 }
 
-int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
+/*
+ * Brings the stream pointers up to date: recovers from xruns and
+ * suspends, moves the mmap data and returns the delay (0 unless
+ * running), avail_update() and the hw pointer it implies.
+ */
+static int oss_dsp_update_ptr(oss_dsp_t *dsp, oss_dsp_stream_t *str, int stream,
+			      snd_pcm_sframes_t *delay, snd_pcm_sframes_t *avail,
+			      snd_pcm_uframes_t *hw_ptr)
+{
+	snd_pcm_t *pcm = str->pcm;
+	snd_pcm_state_t state;
+	int err;
+
+	*delay = 0;
+	state = snd_pcm_state(pcm);
+	if (state == SND_PCM_STATE_XRUN) {
+		err = xrun(dsp, str);
+		if (err < 0)
+			return err;
+		state = snd_pcm_state(pcm);
+	}
+	if (state == SND_PCM_STATE_SUSPENDED) {
+		err = resume(dsp, str);
+		if (err < 0)
+			return err;
+		state = snd_pcm_state(pcm);
+	}
+	if (state == SND_PCM_STATE_RUNNING ||
+	    (state == SND_PCM_STATE_DRAINING && stream == SND_PCM_STREAM_PLAYBACK)) {
+		recovery_check(str);
+		snd_pcm_delay(pcm, delay);
+		if (str->mmap_buffer)
+			oss_dsp_mmap_update(dsp, stream, *delay);
+	}
+	if (str->silence_fill) {
+		oss_dsp_catch_up(str);
+		if (*delay < 0)
+			*delay = 0;
+	}
+	*avail = snd_pcm_avail_update(pcm);
+	if (stream == SND_PCM_STREAM_PLAYBACK)
+		*hw_ptr = (str->alsa.appl_ptr - (str->alsa.buffer_size - *avail)) % str->alsa.boundary;
+	else
+		*hw_ptr = (str->alsa.appl_ptr + *avail) % str->alsa.boundary;
+	return 0;
+}
+
+static void stream_set_avail_min(oss_dsp_stream_t *str, snd_pcm_t *pcm, snd_pcm_uframes_t frames)
+{
+	if (frames == str->avail_min) {
+		str->stats.sw_params_skipped++;
+		return;
+	}
+	str->stats.sw_params_issued++;
+	snd_pcm_sw_params_set_avail_min(pcm, str->sw_params, frames);
+	if (snd_pcm_sw_params(pcm, str->sw_params) < 0)
+		str->avail_min = 0;
+	else
+		str->avail_min = frames;
+}
+
+/*
+ * With ALSA_OSS_MMAP_PUMP=1 each mmap stream gets a thread which wakes
+ * on the pcm descriptors every period and runs the update above, so the
+ * data keeps moving however rarely the application asks for pointers.
+ * While it runs, the pump alone moves the ring pointers and sets
+ * avail_min, and publishes what the ioctls need through a seqlock.
+ * Whatever reconfigures the stream stops it first.  It never takes the
+ * dsp mutex, so joining it with the mutex held is fine.
+ *
+ * The pump does not own the pcm, though: poll() and select() keep
+ * waiting on it meanwhile.  Their descriptors are cached before the pump
+ * starts, so all they still call is snd_pcm_poll_descriptors_revents(),
+ * concurrently with the pump's own calls.  That relies on alsa-lib's per
+ * pcm locking, so no pump is started when it is turned off.
+ */
+static int pump_pcm_shared(void)
+{
+	const char *s = getenv("LIBASOUND_THREAD_SAFE");
+
+	return !s || *s != '0';
+}
+
+static void pump_publish(oss_dsp_stream_t *str, snd_pcm_sframes_t delay,
+			 snd_pcm_sframes_t avail, snd_pcm_uframes_t hw_ptr)
+{
+	unsigned int seq = str->pump_ptr.seq;
+
+	__atomic_store_n(&str->pump_ptr.seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&str->pump_ptr.delay, delay, __ATOMIC_RELAXED);
+	__atomic_store_n(&str->pump_ptr.avail, avail, __ATOMIC_RELAXED);
+	__atomic_store_n(&str->pump_ptr.hw_ptr, hw_ptr, __ATOMIC_RELAXED);
+	__atomic_store_n(&str->pump_ptr.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void pump_read(oss_dsp_stream_t *str, snd_pcm_sframes_t *delay,
+		      snd_pcm_sframes_t *avail, snd_pcm_uframes_t *hw_ptr)
+{
+	unsigned int seq;
+
+	do {
+		seq = __atomic_load_n(&str->pump_ptr.seq, __ATOMIC_ACQUIRE);
+		*delay = __atomic_load_n(&str->pump_ptr.delay, __ATOMIC_RELAXED);
+		*avail = __atomic_load_n(&str->pump_ptr.avail, __ATOMIC_RELAXED);
+		*hw_ptr = __atomic_load_n(&str->pump_ptr.hw_ptr, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&str->pump_ptr.seq, __ATOMIC_RELAXED));
+}
+
+/*
+ * For the ioctls: the pump's last update when it runs, a fresh one
+ * otherwise.  Blocking fds wait for a stream being resumed.
+ */
+static int oss_dsp_sync_ptr(oss_dsp_t *dsp, oss_dsp_stream_t *str, int stream,
+			    snd_pcm_sframes_t *delay, snd_pcm_sframes_t *avail,
+			    snd_pcm_uframes_t *hw_ptr)
+{
+	int err;
+
+	for (;;) {
+		if (str->pump) {
+			pump_read(str, delay, avail, hw_ptr);
+			return 0;
+		}
+		err = oss_dsp_update_ptr(dsp, str, stream, delay, avail, hw_ptr);
+		if (err != -EAGAIN || dsp->nonblock)
+			return err;
+		err = oss_dsp_wait(dsp, str);
+		if (err < 0)
+			return err;
+	}
+}
+
+static void *oss_dsp_pump(void *arg)
+{
+	oss_dsp_stream_t *str = arg;
+	int stream = snd_pcm_stream(str->pcm);
+	/* streams[] is indexed by direction */
+	oss_dsp_t *dsp = (oss_dsp_t *)((char *)(str - stream) - offsetof(oss_dsp_t, streams));
+	snd_pcm_t *pcm = str->pcm;
+	int timeout = str->alsa.period_size * 1000 / str->hw_rate + 1;
+
+	while (!__atomic_load_n(&str->pump_quit, __ATOMIC_ACQUIRE)) {
+		snd_pcm_sframes_t delay, avail;
+		snd_pcm_uframes_t hw_ptr;
+		snd_pcm_state_t state;
+		unsigned short revents;
+		int nfds = 1;
+
+		if (oss_dsp_update_ptr(dsp, str, stream, &delay, &avail, &hw_ptr) >= 0) {
+			pump_publish(str, delay, avail, hw_ptr);
+			state = snd_pcm_state(pcm);
+			if (avail >= 0 && (state == SND_PCM_STATE_RUNNING ||
+					   state == SND_PCM_STATE_DRAINING)) {
+				/* playback is kept filled ahead: wait for one more period */
+				snd_pcm_uframes_t min = avail + str->alsa.period_size;
+				if (min > str->alsa.buffer_size)
+					min = str->alsa.buffer_size;
+				stream_set_avail_min(str, pcm, min);
+				nfds += str->pump_count;
+			}
+		}
+		str->stats.pump_updates++;
+		poll(str->pump_fds, nfds, timeout);
+		if (nfds > 1)
+			snd_pcm_poll_descriptors_revents(pcm, str->pump_fds + 1, str->pump_count, &revents);
+	}
+	return NULL;
+}
+
+static void oss_dsp_pump_start(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	snd_pcm_sframes_t delay, avail;
+	snd_pcm_uframes_t hw_ptr;
+	struct pollfd *fds;
+	int count, err;
+
+	if (!dsp->mmap_pump || !str->pcm || !str->mmap_buffer || str->stopped || str->pump ||
+	    str->busy || dsp->closed || !pump_pcm_shared())
+		return;
+	/* poll()/select() use the cached ones from now on, see above */
+	count = stream_poll_descriptors(str);
+	if (count <= 0)
+		return;
+	fds = realloc(str->pump_fds, (count + 1) * sizeof(*fds));
+	if (!fds)
+		return;
+	str->pump_fds = fds;
+	fds[0].fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fds[0].fd < 0)
+		return;
+	fds[0].events = POLLIN;
+	memcpy(fds + 1, str->pollfds, count * sizeof(*fds));
+	str->pump_count = count;
+	err = oss_dsp_update_ptr(dsp, str, snd_pcm_stream(str->pcm), &delay, &avail, &hw_ptr);
+	if (err < 0)
+		goto _error;
+	pump_publish(str, delay, avail, hw_ptr);
+	str->pump_quit = 0;
+	str->pump = 1;
+	err = pthread_create(&str->pump_thread, NULL, oss_dsp_pump, str);
+	if (err) {
+		str->pump = 0;
+		DEBUG("pump thread: %s\n", strerror(err));
+		goto _error;
+	}
+	if (dsp->rt) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rt_config.priority;
+		pthread_setschedparam(str->pump_thread, rt_config.policy, &param);
+	}
+	DEBUG("pump started for the %s stream\n",
+	      snd_pcm_stream(str->pcm) == SND_PCM_STREAM_PLAYBACK ? "playback" : "capture");
+	return;
+
+ _error:
+	close(fds[0].fd);
+}
+
+static void oss_dsp_pump_stop(oss_dsp_stream_t *str)
+{
+	if (!str->pump)
+		return;
+	__atomic_store_n(&str->pump_quit, 1, __ATOMIC_RELEASE);
+	eventfd_write(str->pump_fds[0].fd, 1);
+	pthread_join(str->pump_thread, NULL);
+	close(str->pump_fds[0].fd);
+	str->pump = 0;
+}
+
+static void oss_dsp_pump_start_all(oss_dsp_t *dsp)
+{
+	int k;
+
+	for (k = 0; k < 2; k++)
+		oss_dsp_pump_start(dsp, &dsp->streams[k]);
+}
+
+static void oss_dsp_pump_stop_all(oss_dsp_t *dsp)
+{
+	int k;
+
+	for (k = 0; k < 2; k++)
+		oss_dsp_pump_stop(&dsp->streams[k]);
+}
+
+/* the pcm stays non-blocking, only the waits in between depend on it */
+static int oss_dsp_nonblock(oss_dsp_t *dsp, int nonblock)
+{
+	dsp->nonblock = !!nonblock;
+	return 0;
+}
+
+/*
+ * Plays out what is staged and queued.  Blocking fds wait for the end,
+ * non-blocking ones only start the drain and get -EAGAIN.
+ */
+static int oss_dsp_drain(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	int err;
+
+	if (snd_pcm_stream(str->pcm) == SND_PCM_STREAM_PLAYBACK) {
+		err = oss_dsp_flush(dsp, str);
+		if (err < 0 && err != -EAGAIN)
+			return err;
+	}
+	err = snd_pcm_drain(str->pcm);
+	if (err != -EAGAIN || dsp->nonblock)
+		return err;
+	while (snd_pcm_state(str->pcm) == SND_PCM_STATE_DRAINING) {
+		err = oss_dsp_wait(dsp, str);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+static int oss_dsp_ioctl(oss_dsp_t *dsp, int fd, unsigned long cmd, void *arg)
 {
 	int result, err = 0;
-	va_list args;
-	void *arg;
-	oss_dsp_t *dsp = look_for_dsp(fd);
 	oss_dsp_stream_t *str;
 	snd_pcm_t *pcm;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		return -1;
-	}
-	va_start(args, cmd);
-	arg = va_arg(args, void *);
-	va_end(args);
 	DEBUG("ioctl(%d, ", fd);
+	if (cmd == SNDCTL_DSP_RESET || cmd == SNDCTL_DSP_SYNC || cmd == SNDCTL_DSP_SETTRIGGER)
+		oss_dsp_pump_stop_all(dsp);
 	switch (cmd) {
 	case OSS_GETVERSION:
 		*(int*)arg = SOUND_VERSION;
@@ -871,6 +2912,11 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 				err = snd_pcm_prepare(pcm);
 			if (err < 0)
 				result = err;
+			oss_dsp_rs_reset(str);
+			str->carry_bytes = 0;
+			str->coal_head = 0;
+			str->coal_bytes = 0;
+			str->silence_skipped = 0;
 			str->oss.bytes = 0;
 			str->oss.hw_bytes = 0;
 			str->alsa.appl_ptr = 0;
@@ -893,14 +2939,28 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 			pcm = str->pcm;
 			if (!pcm)
 				continue;
-			err = snd_pcm_drain(pcm);
+			err = oss_dsp_claim(dsp, str);
+			if (err < 0) {
+				result = err;
+				break;
+			}
+			err = oss_dsp_drain(dsp, str);
+			if (err == -EBADF) {
+				oss_dsp_unclaim(dsp, str);
+				result = err;
+				break;
+			}
 			if (err >= 0)
 				err = snd_pcm_prepare(pcm);
 			if (err < 0)
 				result = err;
+			oss_dsp_rs_reset(str);
+			str->carry_bytes = 0;
+			str->silence_skipped = 0;
 			str->oss.hw_bytes = 0;
 			str->alsa.appl_ptr = 0;
 			str->alsa.old_hw_ptr = 0;
+			oss_dsp_unclaim(dsp, str);
 		}
 		err = result;
 		break;
@@ -948,6 +3008,12 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 		break;
 	case SNDCTL_DSP_POST:
 		DEBUG("SNDCTL_DSP_POST)\n");
+		str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
+		if (str->pcm)
+			err = oss_dsp_coal_flush(dsp, str);
+		/* what the device has no room for yet goes with the next write */
+		if (err == -EAGAIN)
+			err = 0;
 		break;
 	case SNDCTL_DSP_SUBDIVIDE:
 		DEBUG("SNDCTL_DSP_SUBDIVIDE, %p[%d])\n", arg, *(int *)arg);
@@ -979,7 +3045,7 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 	case SNDCTL_DSP_NONBLOCK:
 	{	
 		DEBUG("SNDCTL_DSP_NONBLOCK)\n");
-		return lib_oss_pcm_nonblock(fd, 1);
+		return oss_dsp_nonblock(dsp, 1);
 	}
 	case SNDCTL_DSP_GETCAPS:
 	{
@@ -1024,6 +3090,7 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 					err = snd_pcm_start(pcm);
 					if (err < 0)
 						break;
+					recovery_check(str);
 				}
 			} else {
 				if (!str->stopped) {
@@ -1055,10 +3122,13 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 						snd_pcm_uframes_t size = str->alsa.buffer_size;
 						ssize_t cres;
 						snd_pcm_mmap_begin(pcm, &areas, &offset, &size);
-						snd_pcm_areas_copy(areas, 0, str->mmap_areas, 0,
-								   dsp->channels, size,
-								   dsp->format);
+						if (!str->mmap_direct)
+							snd_pcm_areas_copy(areas, 0, str->mmap_areas, 0,
+									   dsp->channels, size,
+									   dsp->format);
 						cres = snd_pcm_mmap_commit(pcm, offset, size);
+						if (cres > 0 && str->mmap_delta && !str->mmap_direct)
+							mmap_hash_range(str, str->alsa.appl_ptr, cres);
 						if (cres > 0) {
 							str->alsa.appl_ptr += cres;
 							str->alsa.appl_ptr %= str->alsa.boundary;
@@ -1067,6 +3137,7 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 					err = snd_pcm_start(pcm);
 					if (err < 0)
 						break;
+					recovery_check(str);
 				}
 			} else {
 				if (!str->stopped) {
@@ -1088,7 +3159,7 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 	case SNDCTL_DSP_GETISPACE:
 	{
 		snd_pcm_sframes_t avail, delay;
-		snd_pcm_state_t state;
+		snd_pcm_uframes_t hw_ptr;
 		audio_buf_info *info = arg;
 		str = &dsp->streams[SND_PCM_STREAM_CAPTURE];
 		pcm = str->pcm;
@@ -1096,27 +3167,12 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 			err = -EINVAL;
 			break;
 		}
-		state = snd_pcm_state(pcm);
-		if (state == SND_PCM_STATE_XRUN) {
-			err = xrun(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		if (state == SND_PCM_STATE_SUSPENDED) {
-			err = resume(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		if (state == SND_PCM_STATE_RUNNING) {
-			snd_pcm_delay(pcm, &delay);
-			if (str->mmap_buffer)
-				oss_dsp_mmap_update(dsp, SND_PCM_STREAM_CAPTURE, delay);
-		}
-		avail = snd_pcm_avail_update(pcm);
+		err = oss_dsp_sync_ptr(dsp, str, SND_PCM_STREAM_CAPTURE, &delay, &avail, &hw_ptr);
+		if (err < 0)
+			break;
 		if (avail < 0)
 			avail = 0;
+		avail = oss_frames(dsp, str, avail) + str->rs_count;
 		if ((snd_pcm_uframes_t)avail > str->oss.buffer_size)
 			avail = str->oss.buffer_size;
 		info->fragsize = str->oss.period_size * str->frame_bytes;
@@ -1133,7 +3189,7 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 	case SNDCTL_DSP_GETOSPACE:
 	{
 		snd_pcm_sframes_t avail, delay;
-		snd_pcm_state_t state;
+		snd_pcm_uframes_t hw_ptr, staged;
 		audio_buf_info *info = arg;
 		str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
 		pcm = str->pcm;
@@ -1141,28 +3197,17 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 			err = -EINVAL;
 			break;
 		}
-		state = snd_pcm_state(pcm);
-		if (state == SND_PCM_STATE_XRUN) {
-			err = xrun(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		if (state == SND_PCM_STATE_SUSPENDED) {
-			err = resume(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		if (state == SND_PCM_STATE_RUNNING || 
-		    state == SND_PCM_STATE_DRAINING) {
-			snd_pcm_delay(pcm, &delay);
-			if (str->mmap_buffer)
-				oss_dsp_mmap_update(dsp, SND_PCM_STREAM_PLAYBACK, delay);
-		}
-		avail = snd_pcm_avail_update(pcm);
+		/* staged bytes would not show in the device pointers */
+		staged = oss_dsp_coal_push(dsp, str);
+		err = oss_dsp_sync_ptr(dsp, str, SND_PCM_STREAM_PLAYBACK, &delay, &avail, &hw_ptr);
+		if (err < 0)
+			break;
+		if (avail >= 0)
+			avail = oss_frames(dsp, str, avail > (snd_pcm_sframes_t)str->rs_count ?
+					   avail - (snd_pcm_sframes_t)str->rs_count : 0);
 		if (avail < 0 || (snd_pcm_uframes_t)avail > str->oss.buffer_size)
 			avail = str->oss.buffer_size;
+		avail = (snd_pcm_uframes_t)avail > staged ? avail - (snd_pcm_sframes_t)staged : 0;
 		info->fragsize = str->oss.period_size * str->frame_bytes;
 		info->fragstotal = str->oss.periods;
 		info->bytes = avail * str->frame_bytes;
@@ -1176,9 +3221,8 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 	}
 	case SNDCTL_DSP_GETIPTR:
 	{
-		snd_pcm_sframes_t delay = 0, avail, diff;
+		snd_pcm_sframes_t delay, avail, diff;
 		snd_pcm_uframes_t hw_ptr;
-		snd_pcm_state_t state;
 		count_info *info = arg;
 		str = &dsp->streams[SND_PCM_STREAM_CAPTURE];
 		pcm = str->pcm;
@@ -1186,40 +3230,23 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 			err = -EINVAL;
 			break;
 		}
-		state = snd_pcm_state(pcm);
-		if (state == SND_PCM_STATE_XRUN) {
-			err = xrun(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		if (state == SND_PCM_STATE_SUSPENDED) {
-			err = resume(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		if (state == SND_PCM_STATE_RUNNING) {
-			snd_pcm_delay(pcm, &delay);
-			if (str->mmap_buffer)
-				oss_dsp_mmap_update(dsp, SND_PCM_STREAM_CAPTURE, delay);
-		}
-		avail = snd_pcm_avail_update(pcm);
-		hw_ptr = (str->alsa.appl_ptr + avail) % str->alsa.boundary;
+		err = oss_dsp_sync_ptr(dsp, str, SND_PCM_STREAM_CAPTURE, &delay, &avail, &hw_ptr);
+		if (err < 0)
+			break;
 		diff = hw_ptr - str->alsa.old_hw_ptr;
 		if (diff < 0)
 			diff += str->alsa.boundary;
 		str->oss.hw_bytes += diff;
 		str->oss.hw_bytes %= str->oss.boundary;
-		info->bytes = (str->oss.hw_bytes * str->frame_bytes) & 0x7fffffff;
-		info->ptr = (str->oss.hw_bytes % str->oss.buffer_size) * str->frame_bytes;
+		info->bytes = (oss_frames(dsp, str, str->oss.hw_bytes) * str->frame_bytes) & 0x7fffffff;
+		info->ptr = (oss_frames(dsp, str, str->oss.hw_bytes) % str->oss.buffer_size) * str->frame_bytes;
 		if (str->mmap_buffer) {
 			ssize_t n = (hw_ptr / str->oss.period_size) - (str->alsa.old_hw_ptr / str->oss.period_size);
 			if (n < 0)
 				n += str->alsa.boundary / str->oss.period_size;
 			info->blocks = n;
 		} else {
-			info->blocks = delay / str->oss.period_size;
+			info->blocks = oss_frames(dsp, str, delay) / str->oss.period_size;
 		}
 		str->alsa.old_hw_ptr = hw_ptr;
 		DEBUG("SNDCTL_DSP_GETIPTR, %p) -> {%d %d %d}\n", arg,
@@ -1230,51 +3257,41 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 	}
 	case SNDCTL_DSP_GETOPTR:
 	{
-		snd_pcm_sframes_t delay = 0, avail, diff;
+		snd_pcm_sframes_t delay, avail, diff;
 		snd_pcm_uframes_t hw_ptr;
-		snd_pcm_state_t state;
 		count_info *info = arg;
 		str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
 		pcm = str->pcm;
 		if (!pcm) {
 			err = -EINVAL;
-			break;
-		}
-		if (state == SND_PCM_STATE_XRUN) {
-			err = xrun(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		state = snd_pcm_state(pcm);
-		if (state == SND_PCM_STATE_SUSPENDED) {
-			err = resume(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		if (state == SND_PCM_STATE_RUNNING || 
-		    state == SND_PCM_STATE_DRAINING) {
-			snd_pcm_delay(pcm, &delay);
-			if (str->mmap_buffer)
-				oss_dsp_mmap_update(dsp, SND_PCM_STREAM_PLAYBACK, delay);
+			break;
 		}
-		avail = snd_pcm_avail_update(pcm);
-		hw_ptr = (str->alsa.appl_ptr - (str->alsa.buffer_size - avail)) % str->alsa.boundary;
+		oss_dsp_coal_push(dsp, str);
+		err = oss_dsp_sync_ptr(dsp, str, SND_PCM_STREAM_PLAYBACK, &delay, &avail, &hw_ptr);
+		if (err < 0)
+			break;
 		diff = hw_ptr - str->alsa.old_hw_ptr;
 		if (diff < 0)
 			diff += str->alsa.boundary;
+		/* the silence played while starved was never written */
+		if ((snd_pcm_uframes_t)diff >= str->silence_skipped) {
+			diff -= str->silence_skipped;
+			str->silence_skipped = 0;
+		} else {
+			str->silence_skipped -= diff;
+			diff = 0;
+		}
 		str->oss.hw_bytes += diff;
 		str->oss.hw_bytes %= str->oss.boundary;
-		info->bytes = (str->oss.hw_bytes * str->frame_bytes) & 0x7fffffff;
-		info->ptr = (str->oss.hw_bytes % str->oss.buffer_size) * str->frame_bytes;
+		info->bytes = (oss_frames(dsp, str, str->oss.hw_bytes) * str->frame_bytes) & 0x7fffffff;
+		info->ptr = (oss_frames(dsp, str, str->oss.hw_bytes) % str->oss.buffer_size) * str->frame_bytes;
 		if (str->mmap_buffer) {
 			ssize_t n = (hw_ptr / str->oss.period_size) - (str->alsa.old_hw_ptr / str->oss.period_size);
 			if (n < 0)
 				n += str->alsa.boundary / str->oss.period_size;
 			info->blocks = n;
 		} else {
-			info->blocks = delay / str->oss.period_size;
+			info->blocks = oss_frames(dsp, str, delay) / str->oss.period_size;
 		}
 		str->alsa.old_hw_ptr = hw_ptr;
 		DEBUG("SNDCTL_DSP_GETOPTR, %p) -> {%d %d %d}\n", arg,
@@ -1285,28 +3302,20 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 	}
 	case SNDCTL_DSP_GETODELAY:
 	{
-		snd_pcm_sframes_t delay = 0;
-		snd_pcm_state_t state;
+		snd_pcm_sframes_t delay, avail;
+		snd_pcm_uframes_t hw_ptr, staged;
 		str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
 		pcm = str->pcm;
 		if (!pcm) {
 			err = -EINVAL;
 			break;
 		}
-		state = snd_pcm_state(pcm);
-		if (state == SND_PCM_STATE_SUSPENDED) {
-			err = resume(pcm);
-			if (err < 0)
-				break;
-			state = snd_pcm_state(pcm);
-		}
-		if (state == SND_PCM_STATE_RUNNING || 
-		    state == SND_PCM_STATE_DRAINING) {
-			snd_pcm_delay(pcm, &delay);
-			if (str->mmap_buffer)
-				oss_dsp_mmap_update(dsp, SND_PCM_STREAM_PLAYBACK, delay);
-		}
-		*(int *)arg = delay * str->frame_bytes;
+		staged = oss_dsp_coal_push(dsp, str);
+		err = oss_dsp_sync_ptr(dsp, str, SND_PCM_STREAM_PLAYBACK, &delay, &avail, &hw_ptr);
+		if (err < 0)
+			break;
+		*(int *)arg = (oss_frames(dsp, str, delay + str->rs_count) + staged) *
+			      str->frame_bytes;
 		DEBUG("SNDCTL_DSP_GETODELAY, %p) -> [%d]\n", arg, *(int*)arg); 
 		break;
 	}
@@ -1357,6 +3366,7 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 		err = -ENXIO;
 		break;
 	}
+	oss_dsp_pump_start_all(dsp);
 	if (err >= 0)
 		return 0;
 	DEBUG("dsp ioctl error = %d\n", err);
@@ -1364,40 +3374,96 @@ int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
 	return -1;
 }
 
-int lib_oss_pcm_nonblock(int fd, int nonblock)
+/*
+ * The shadow buffer is an anonymous mapping, page aligned and populated
+ * up front like the device buffer it stands for, and locked in real-time
+ * mode.  ALSA_OSS_MMAP_HUGE=1 tries huge pages first.  Refused flags are
+ * dropped rather than failing the mmap().
+ */
+#define HUGE_PAGE_SIZE	(2UL << 20)	/* the usual default */
+
+static void *shadow_alloc(oss_dsp_t *dsp, oss_dsp_stream_t *str, size_t len)
 {
-	oss_dsp_t *dsp = look_for_dsp(fd);
-	int k;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	void *p;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		return -1;
-	}
-	for (k = 0; k < 2; ++k) {
-		snd_pcm_t *pcm = dsp->streams[k].pcm;
-		int err;
-		if (!pcm)
-			continue;
-		err = snd_pcm_nonblock(pcm, nonblock);
-		if (err < 0) {
-			errno = -err;
-			return -1;
+	if (dsp->rt)
+		flags |= MAP_LOCKED;
+#ifdef MAP_HUGETLB
+	if (dsp->mmap_huge) {
+		size_t size = (len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			str->mmap_alloc = size;
+			return p;
 		}
+		DEBUG("mmap: no huge pages: %s\n", strerror(errno));
 	}
-	return 0;
+#endif
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED && (flags & MAP_LOCKED))
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags & ~MAP_LOCKED, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	str->mmap_alloc = len;
+	return p;
+}
+
+static void shadow_free(oss_dsp_stream_t *str)
+{
+	if (!str->mmap_alloc)
+		return;
+	munmap(str->mmap_buffer, str->mmap_alloc);
+	str->mmap_alloc = 0;
+}
+
+/*
+ * When the hw ring has exactly the layout the application asked for,
+ * the application gets the ring itself and mmap_update only moves the
+ * pointers; otherwise it keeps the shadow buffer, copied on every update.
+ */
+static int oss_dsp_mmap_direct(oss_dsp_t *dsp, oss_dsp_stream_t *str)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t ofs, frames = 0;
+	unsigned int c, bits = snd_pcm_format_physical_width(dsp->format);
+	void *base;
+
+	if (dsp->no_mmap_direct || snd_pcm_type(str->pcm) != SND_PCM_TYPE_HW ||
+	    str->hw_format != dsp->format ||
+	    str->oss.buffer_size != str->alsa.buffer_size ||
+	    str->mmap_bytes != str->alsa.buffer_size * str->frame_bytes)
+		return 0;
+	if (snd_pcm_mmap_begin(str->pcm, &areas, &ofs, &frames) < 0)
+		return 0;
+	base = areas[0].addr;
+	for (c = 0; c < dsp->channels; c++) {
+		if (areas[c].addr != base || areas[c].first != c * bits ||
+		    areas[c].step != bits * dsp->channels)
+			return 0;
+	}
+	shadow_free(str);
+	str->mmap_buffer = base;
+	for (c = 0; c < dsp->channels; c++)
+		str->mmap_areas[c].addr = base;
+	str->mmap_direct = 1;
+	dsp->direct.oss_format = dsp->oss_format;
+	dsp->direct.channels = dsp->channels;
+	dsp->direct.rate = dsp->rate;
+	dsp->direct.fragshift = dsp->fragshift;
+	dsp->direct.maxfrags = dsp->maxfrags;
+	dsp->direct.subdivision = dsp->subdivision;
+	DEBUG("mmap: handing out the device buffer %p\n", base);
+	return 1;
 }
 
-void * lib_oss_pcm_mmap(void *addr ATTRIBUTE_UNUSED, size_t len ATTRIBUTE_UNUSED, int prot, int flags ATTRIBUTE_UNUSED, int fd, off_t offset ATTRIBUTE_UNUSED)
+static void *oss_dsp_mmap(fd_t *xfd, void *addr ATTRIBUTE_UNUSED, size_t len ATTRIBUTE_UNUSED, int prot, int flags ATTRIBUTE_UNUSED, int fd, off_t offset ATTRIBUTE_UNUSED)
 {
 	int err;
 	void *result;
-	oss_dsp_t *dsp = look_for_dsp(fd);
+	oss_dsp_t *dsp = xfd->dsp;
 	oss_dsp_stream_t *str;
 
-	if (dsp == NULL) {
-		errno = -EBADFD;
-		return MAP_FAILED;
-	}
 	switch (prot & (PROT_READ | PROT_WRITE)) {
 	case PROT_READ:
 		str = &dsp->streams[SND_PCM_STREAM_CAPTURE];
@@ -1421,8 +3487,9 @@ void * lib_oss_pcm_mmap(void *addr ATTRIBUTE_UNUSED, size_t len ATTRIBUTE_UNUSED
 		goto _end;
 	}
 	assert(!str->mmap_buffer);
-	result = malloc(len);
+	result = shadow_alloc(dsp, str, len);
 	if (!result) {
+		errno = ENOMEM;
 		result = MAP_FAILED;
 		goto _end;
 	}
@@ -1432,37 +3499,42 @@ void * lib_oss_pcm_mmap(void *addr ATTRIBUTE_UNUSED, size_t len ATTRIBUTE_UNUSED
 	str->alsa.mmap_buffer_bytes = str->oss.buffer_size * str->frame_bytes;
 	err = oss_dsp_params(dsp);
 	if (err < 0) {
-		free(result);
+		shadow_free(str);
 		str->mmap_buffer = NULL;
 		str->mmap_bytes = 0;
 		errno = -err;
 		result = MAP_FAILED;
 		goto _end;
 	}
+	if (oss_dsp_mmap_direct(dsp, str))
+		result = str->mmap_buffer;
+	insert_mmap_fd(xfd, str - dsp->streams, result);
+	oss_dsp_pump_start_all(dsp);
  _end:
 	DEBUG("mmap(%p, %lu, %d, %d, %d, %ld) -> %p\n", addr, (unsigned long)len, prot, flags, fd, offset, result);
 	return result;
 }
 
-int lib_oss_pcm_munmap(void *addr, size_t len)
+static int oss_dsp_munmap(fd_t *xfd, void *addr, size_t len)
 {
 	int err;
-	oss_dsp_t *dsp = look_for_mmap_addr(addr);
+	oss_dsp_t *dsp = xfd->dsp;
 	oss_dsp_stream_t *str;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		return -1;
-	}
+	remove_mmap_fd(xfd, addr);
 	DEBUG("munmap(%p, %lu)\n", addr, (unsigned long)len);
+	oss_dsp_pump_stop_all(dsp);
 	str = &dsp->streams[SND_PCM_STREAM_PLAYBACK];
-	if (!str->pcm)
+	if (str->mmap_buffer != addr)
 		str = &dsp->streams[SND_PCM_STREAM_CAPTURE];
-	assert(str->mmap_buffer);
-	free(str->mmap_buffer);
+	assert(str->mmap_buffer == addr);
+	/* a device ring goes away with the next hw_params */
+	shadow_free(str);
+	str->mmap_direct = 0;
 	str->mmap_buffer = 0;
 	str->mmap_bytes = 0;
 	err = oss_dsp_params(dsp);
+	oss_dsp_pump_start_all(dsp);
 	if (err < 0) {
 		errno = -err;
 		return -1;
@@ -1484,140 +3556,110 @@ static void set_oss_mmap_avail_min(oss_dsp_stream_t *str, int stream ATTRIBUTE_U
 	if (diff < 1)
 		diff = 1;
 	//fprintf(stderr, "avail_min (%i): hw_ptr = %lu, appl_ptr = %lu, diff = %lu\n", stream, hw_ptr, str->alsa.appl_ptr, diff);
-	snd_pcm_sw_params_set_avail_min(pcm, str->sw_params, diff);
-	snd_pcm_sw_params(pcm, str->sw_params);
+	stream_set_avail_min(str, pcm, diff);
 }
 
-int lib_oss_pcm_select_prepare(int fd, int fmode, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+static int oss_dsp_select_prepare(oss_dsp_t *dsp, int fmode, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
 {
-	oss_dsp_t *dsp = look_for_dsp(fd);
 	int k, maxfd = -1;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		return -1;
-	}
 	for (k = 0; k < 2; ++k) {
 		oss_dsp_stream_t *str = &dsp->streams[k];
 		snd_pcm_t *pcm = str->pcm;
-		int err, count;
+		int j, count;
 		if (!pcm)
 			continue;
 		if ((fmode & O_ACCMODE) == O_RDONLY && snd_pcm_stream(pcm) == SND_PCM_STREAM_PLAYBACK)
 			continue;
 		if ((fmode & O_ACCMODE) == O_WRONLY && snd_pcm_stream(pcm) == SND_PCM_STREAM_CAPTURE)
 			continue;
-		if (str->mmap_buffer)
+		/* a running pump sets its own */
+		if (str->mmap_buffer && !str->pump)
 			set_oss_mmap_avail_min(str, k, pcm);
-		count = snd_pcm_poll_descriptors_count(pcm);
+		count = stream_poll_descriptors(str);
 		if (count < 0) {
 			errno = -count;
 			return -1;
 		}
-		{
-			struct pollfd ufds[count];
-			int j;
-			err = snd_pcm_poll_descriptors(pcm, ufds, count);
-			if (err < 0) {
-				errno = -err;
-				return -1;
+		for (j = 0; j < count; j++) {
+			int fd = str->pollfds[j].fd;
+			unsigned short events = str->pollfds[j].events;
+			if (maxfd < fd)
+				maxfd = fd;
+			if (readfds) {
+				FD_CLR(fd, readfds);
+				if (events & POLLIN)
+					FD_SET(fd, readfds);
 			}
-			for (j = 0; j < count; j++) {
-				int fd = ufds[j].fd;
-				unsigned short events = ufds[j].events;
-				if (maxfd < fd)
-					maxfd = fd;
-				if (readfds) {
-					FD_CLR(fd, readfds);
-					if (events & POLLIN)
-						FD_SET(fd, readfds);
-				}
-				if (writefds) {
-					FD_CLR(fd, writefds);
-					if (events & POLLOUT)
-						FD_SET(fd, writefds);
-				}
-				if (exceptfds) {
-					FD_CLR(fd, exceptfds);
-					if (events & (POLLERR|POLLNVAL))
-						FD_SET(fd, exceptfds);
-				}
+			if (writefds) {
+				FD_CLR(fd, writefds);
+				if (events & POLLOUT)
+					FD_SET(fd, writefds);
+			}
+			if (exceptfds) {
+				FD_CLR(fd, exceptfds);
+				if (events & (POLLERR|POLLNVAL))
+					FD_SET(fd, exceptfds);
 			}
 		}
 	}	
 	return maxfd;
 }
 
-int lib_oss_pcm_select_result(int fd, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+static int oss_dsp_select_result(oss_dsp_t *dsp, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
 {
-	oss_dsp_t *dsp = look_for_dsp(fd);
 	int k, result = 0;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		return -1;
-	}
 	for (k = 0; k < 2; ++k) {
-		snd_pcm_t *pcm = dsp->streams[k].pcm;
-		int err, count;
+		oss_dsp_stream_t *str = &dsp->streams[k];
+		snd_pcm_t *pcm = str->pcm;
+		struct pollfd *ufds = str->pollfds;
+		int err, j, count;
+		unsigned short revents;
 		if (!pcm)
 			continue;
-		count = snd_pcm_poll_descriptors_count(pcm);
+		count = stream_poll_descriptors(str);
 		if (count < 0) {
 			errno = -count;
 			return -1;
 		}
-		{
-			struct pollfd ufds[count];
-			int j;
-			unsigned short revents;
-			err = snd_pcm_poll_descriptors(pcm, ufds, count);
-			if (err < 0) {
-				errno = -err;
-				return -1;
-			}
-			for (j = 0; j < count; j++) {
-				int fd = ufds[j].fd;
-				revents = 0;
-				if (readfds && FD_ISSET(fd, readfds))
-					revents |= POLLIN;
-				if (writefds && FD_ISSET(fd, writefds))
-					revents |= POLLOUT;
-				if (exceptfds && FD_ISSET(fd, exceptfds))
-					revents |= POLLERR;
-				ufds[j].revents = revents;
-			}
-			err = snd_pcm_poll_descriptors_revents(pcm, ufds, count, &revents);
-			if (err < 0) {
-				errno = -err;
-				return -1;
-			}
-			if (revents & (POLLNVAL|POLLERR))
-				result |= OSS_WAIT_EVENT_ERROR;
-			if (revents & POLLIN)
-				result |= OSS_WAIT_EVENT_READ;
-			if (revents & POLLOUT)
-				result |= OSS_WAIT_EVENT_WRITE;
+		/* the cached array doubles as the revents scratch */
+		for (j = 0; j < count; j++) {
+			int fd = ufds[j].fd;
+			revents = 0;
+			if (readfds && FD_ISSET(fd, readfds))
+				revents |= POLLIN;
+			if (writefds && FD_ISSET(fd, writefds))
+				revents |= POLLOUT;
+			if (exceptfds && FD_ISSET(fd, exceptfds))
+				revents |= POLLERR;
+			ufds[j].revents = revents;
+		}
+		err = snd_pcm_poll_descriptors_revents(pcm, ufds, count, &revents);
+		if (err < 0) {
+			errno = -err;
+			return -1;
 		}
+		if (revents & (POLLNVAL|POLLERR))
+			result |= OSS_WAIT_EVENT_ERROR;
+		if (revents & POLLIN)
+			result |= OSS_WAIT_EVENT_READ;
+		if (revents & POLLOUT)
+			result |= OSS_WAIT_EVENT_WRITE;
 	}	
 	return result;
 }
 
-extern int lib_oss_pcm_poll_fds(int fd)
+static int oss_dsp_poll_fds(oss_dsp_t *dsp)
 {
-	oss_dsp_t *dsp = look_for_dsp(fd);
 	int k, result = 0;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		return -1;
-	}
 	for (k = 0; k < 2; ++k) {
-		snd_pcm_t *pcm = dsp->streams[k].pcm;
+		oss_dsp_stream_t *str = &dsp->streams[k];
 		int err;
-		if (!pcm)
+		if (!str->pcm)
 			continue;
-		err = snd_pcm_poll_descriptors_count(pcm);
+		err = stream_poll_descriptors(str);
 		if (err < 0) {
 			errno = -err;
 			return -1;
@@ -1627,59 +3669,49 @@ extern int lib_oss_pcm_poll_fds(int fd)
 	return result;
 }
 
-int lib_oss_pcm_poll_prepare(int fd, int fmode, struct pollfd *ufds)
+static int oss_dsp_poll_prepare(oss_dsp_t *dsp, int fmode, struct pollfd *ufds)
 {
-	oss_dsp_t *dsp = look_for_dsp(fd);
 	int k, result = 0;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		return -1;
-	}
 	for (k = 0; k < 2; ++k) {
 		oss_dsp_stream_t *str = &dsp->streams[k];
 		snd_pcm_t *pcm = str->pcm;
-		int err, count;
+		int count;
 		if (!pcm)
 			continue;
+		str->polled = 0;
 		if ((fmode & O_ACCMODE) == O_RDONLY && snd_pcm_stream(pcm) == SND_PCM_STREAM_PLAYBACK)
 			continue;
 		if ((fmode & O_ACCMODE) == O_WRONLY && snd_pcm_stream(pcm) == SND_PCM_STREAM_CAPTURE)
 			continue;
-		if (str->mmap_buffer)
+		/* a running pump sets its own */
+		if (str->mmap_buffer && !str->pump)
 			set_oss_mmap_avail_min(str, k, pcm);
-		count = snd_pcm_poll_descriptors_count(pcm);
+		count = stream_poll_descriptors(str);
 		if (count < 0) {
 			errno = -count;
 			return -1;
 		}
-		err = snd_pcm_poll_descriptors(pcm, ufds, count);
-		if (err < 0) {
-			errno = -err;
-			return -1;
-		}
+		str->polled = 1;
+		memcpy(ufds, str->pollfds, count * sizeof(*ufds));
 		ufds += count;
 		result += count;
 	}	
 	return result;
 }
 
-int lib_oss_pcm_poll_result(int fd, struct pollfd *ufds)
+static int oss_dsp_poll_result(oss_dsp_t *dsp, struct pollfd *ufds)
 {
-	oss_dsp_t *dsp = look_for_dsp(fd);
 	int k, result = 0;
 
-	if (dsp == NULL) {
-		errno = EBADFD;
-		return -1;
-	}
 	for (k = 0; k < 2; ++k) {
 		snd_pcm_t *pcm = dsp->streams[k].pcm;
 		int err, count;
 		unsigned short revents;
-		if (!pcm)
+		/* ufds only holds the streams poll_prepare filled in */
+		if (!pcm || !dsp->streams[k].polled)
 			continue;
-		count = snd_pcm_poll_descriptors_count(pcm);
+		count = stream_poll_descriptors(&dsp->streams[k]);
 		if (count < 0) {
 			errno = -count;
 			return -1;
@@ -1701,6 +3733,201 @@ int lib_oss_pcm_poll_result(int fd, struct pollfd *ufds)
 }
 
 
+ssize_t lib_oss_pcm_write(int fd, const void *buf, size_t n)
+{
+	ssize_t result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_write(xfd->dsp, fd, buf, n);
+	put_fd(xfd);
+	return result;
+}
+
+ssize_t lib_oss_pcm_read(int fd, void *buf, size_t n)
+{
+	ssize_t result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_read(xfd->dsp, fd, buf, n);
+	put_fd(xfd);
+	return result;
+}
+
+ssize_t lib_oss_pcm_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_writev(xfd->dsp, fd, iov, iovcnt);
+	put_fd(xfd);
+	return result;
+}
+
+ssize_t lib_oss_pcm_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_readv(xfd->dsp, fd, iov, iovcnt);
+	put_fd(xfd);
+	return result;
+}
+
+int lib_oss_pcm_ioctl(int fd, unsigned long cmd, ...)
+{
+	int result;
+	va_list args;
+	void *arg;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	va_start(args, cmd);
+	arg = va_arg(args, void *);
+	va_end(args);
+	result = oss_dsp_ioctl(xfd->dsp, fd, cmd, arg);
+	put_fd(xfd);
+	return result;
+}
+
+int lib_oss_pcm_nonblock(int fd, int nonblock)
+{
+	int result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_nonblock(xfd->dsp, nonblock);
+	put_fd(xfd);
+	return result;
+}
+
+void * lib_oss_pcm_mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+	void *result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return MAP_FAILED;
+	}
+	result = oss_dsp_mmap(xfd, addr, len, prot, flags, fd, offset);
+	put_fd(xfd);
+	return result;
+}
+
+int lib_oss_pcm_munmap(void *addr, size_t len)
+{
+	int result;
+	fd_t *xfd;
+
+	fd_table_enter(&pcm_fds);
+	xfd = look_for_mmap_addr(addr);
+	if (xfd == NULL) {
+		fd_table_leave(&pcm_fds);
+		return mmap_orphan_release(addr, len);
+	}
+	pthread_mutex_lock(&xfd->dsp->mutex);
+	if (xfd->dsp->closed) {
+		put_fd(xfd);
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_munmap(xfd, addr, len);
+	put_fd(xfd);
+	return result;
+}
+
+int lib_oss_pcm_select_prepare(int fd, int fmode, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+{
+	int result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_select_prepare(xfd->dsp, fmode, readfds, writefds, exceptfds);
+	put_fd(xfd);
+	return result;
+}
+
+int lib_oss_pcm_select_result(int fd, fd_set *readfds, fd_set *writefds, fd_set *exceptfds)
+{
+	int result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_select_result(xfd->dsp, readfds, writefds, exceptfds);
+	put_fd(xfd);
+	return result;
+}
+
+int lib_oss_pcm_poll_fds(int fd)
+{
+	int result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_poll_fds(xfd->dsp);
+	put_fd(xfd);
+	return result;
+}
+
+int lib_oss_pcm_poll_prepare(int fd, int fmode, struct pollfd *ufds)
+{
+	int result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_poll_prepare(xfd->dsp, fmode, ufds);
+	put_fd(xfd);
+	return result;
+}
+
+int lib_oss_pcm_poll_result(int fd, struct pollfd *ufds)
+{
+	int result;
+	fd_t *xfd = get_fd(fd);
+
+	if (xfd == NULL) {
+		errno = EBADFD;
+		return -1;
+	}
+	result = oss_dsp_poll_result(xfd->dsp, ufds);
+	put_fd(xfd);
+	return result;
+}
+
 static void error_handler(const char *file ATTRIBUTE_UNUSED,
 			  int line ATTRIBUTE_UNUSED,
 			  const char *func ATTRIBUTE_UNUSED,
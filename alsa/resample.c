@@ -0,0 +1,287 @@
+/*
+ *  OSS -> ALSA compatibility layer
+ *  Polyphase sample rate converter
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "resample.h"
+
+/*
+ * The rate ratio is reduced to out/in = L/M.  Conceptually the input is
+ * upsampled by L, lowpassed and decimated by M; only the L phases of the
+ * windowed sinc which hit an output are ever computed, each taps long.
+ * The cutoff follows the lower of both rates, so when downsampling the
+ * taps are multiplied by ceil(M / L) to keep the transition band as
+ * narrow, relative to the output rate, as the preset asks for.
+ * Ratios needing more than MAX_PHASES phases are approximated by the
+ * closest one which does not, which is off by a few ppm at worst.
+ */
+#define MAX_PHASES	1024
+#define COEF_SHIFT	28	/* a phase sums to 1 << COEF_SHIFT */
+
+static const struct {
+	const char *name;
+	unsigned int taps;
+	double rolloff;		/* passband edge relative to the lower Nyquist */
+	double beta;		/* Kaiser window */
+} presets[] = {
+	{ "fast", 8, 0.80, 5.0 },
+	{ "medium", 16, 0.90, 7.0 },
+	{ "best", 32, 0.95, 9.0 },
+};
+
+#define NPRESETS	(sizeof(presets) / sizeof(presets[0]))
+#define DEFAULT_QUALITY	2
+
+struct alsa_oss_resampler {
+	unsigned int channels;
+	unsigned int taps;
+	unsigned int phases;		/* L */
+	unsigned int step;		/* M */
+	unsigned int phase;		/* of the next output, < L */
+	size_t pos;			/* first frame of its window in buf */
+	size_t fill;			/* frames in buf */
+	size_t max_in;
+	int32_t *coefs;			/* phases x taps, oldest frame first */
+	int32_t *buf;			/* taps - 1 + max_in frames */
+};
+
+unsigned int alsa_oss_resample_quality(const char *name)
+{
+	unsigned int k;
+
+	if (!name || !*name || !strcmp(name, "0") || !strcmp(name, "off") ||
+	    !strcmp(name, "no"))
+		return 0;
+	for (k = 0; k < NPRESETS; k++) {
+		if (!strcmp(name, presets[k].name))
+			return k + 1;
+	}
+	return DEFAULT_QUALITY;
+}
+
+const char *alsa_oss_resample_quality_name(unsigned int quality)
+{
+	if (quality < 1 || quality > NPRESETS)
+		return "off";
+	return presets[quality - 1].name;
+}
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		unsigned int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+static void reduce_ratio(unsigned int in_rate, unsigned int out_rate,
+			 unsigned int *l, unsigned int *m)
+{
+	unsigned int g = gcd(in_rate, out_rate), k;
+	double ratio, best = 1e9;
+
+	*l = out_rate / g;
+	*m = in_rate / g;
+	if (*l <= MAX_PHASES)
+		return;
+	ratio = (double)in_rate / out_rate;
+	for (k = 1; k <= MAX_PHASES; k++) {
+		unsigned int mk = (unsigned int)(k * ratio + 0.5);
+		double e;
+		if (!mk)
+			continue;
+		e = fabs((double)mk / k - ratio);
+		if (e < best) {
+			best = e;
+			*l = k;
+			*m = mk;
+		}
+	}
+}
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	int k;
+
+	for (k = 1; k < 50; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+		if (term < sum * 1e-12)
+			break;
+	}
+	return sum;
+}
+
+static int make_coefs(alsa_oss_resampler_t *r, unsigned int quality)
+{
+	unsigned int taps = r->taps, l = r->phases, p, k;
+	unsigned int len = taps * l;
+	double fc, center, i0beta, beta = presets[quality - 1].beta;
+	double *h;
+
+	h = malloc(taps * sizeof(*h));
+	if (!h)
+		return -1;
+	r->coefs = malloc((size_t)len * sizeof(*r->coefs));
+	if (!r->coefs) {
+		free(h);
+		return -1;
+	}
+	/* cutoff in cycles per sample of the upsampled stream */
+	fc = presets[quality - 1].rolloff * 0.5 / (l > r->step ? l : r->step);
+	center = (len - 1) / 2.0;
+	i0beta = bessel_i0(beta);
+	for (p = 0; p < l; p++) {
+		double sum = 0;
+		int32_t *c = r->coefs + p * taps;
+		for (k = 0; k < taps; k++) {
+			/* window slot k is x[i - (taps - 1) + k], prototype tap p + (taps - 1 - k) * L */
+			double n = p + (double)(taps - 1 - k) * l;
+			double t = n - center, w, s;
+			double u = 2 * n / (len - 1) - 1;
+			w = bessel_i0(beta * sqrt(u * u < 1 ? 1 - u * u : 0)) / i0beta;
+			s = t == 0 ? 1 : sin(2 * M_PI * fc * t) / (2 * M_PI * fc * t);
+			h[k] = s * w;
+			sum += h[k];
+		}
+		for (k = 0; k < taps; k++)
+			c[k] = (int32_t)lrint(h[k] / sum * (1 << COEF_SHIFT));
+	}
+	free(h);
+	return 0;
+}
+
+alsa_oss_resampler_t *alsa_oss_resampler_new(unsigned int in_rate, unsigned int out_rate,
+					     unsigned int channels, unsigned int quality,
+					     size_t max_in)
+{
+	alsa_oss_resampler_t *r;
+
+	if (!in_rate || !out_rate || !channels || !max_in)
+		return NULL;
+	if (quality < 1 || quality > NPRESETS)
+		quality = DEFAULT_QUALITY;
+	r = calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->channels = channels;
+	r->taps = presets[quality - 1].taps;
+	r->max_in = max_in;
+	reduce_ratio(in_rate, out_rate, &r->phases, &r->step);
+	if (r->step > r->phases)
+		r->taps *= (r->step + r->phases - 1) / r->phases;
+	if (make_coefs(r, quality) < 0)
+		goto _error;
+	r->buf = malloc((r->taps - 1 + max_in) * channels * sizeof(*r->buf));
+	if (!r->buf)
+		goto _error;
+	alsa_oss_resampler_reset(r);
+	return r;
+
+ _error:
+	alsa_oss_resampler_free(r);
+	return NULL;
+}
+
+void alsa_oss_resampler_free(alsa_oss_resampler_t *r)
+{
+	if (!r)
+		return;
+	free(r->coefs);
+	free(r->buf);
+	free(r);
+}
+
+/* starts over from silence, the filter delay is half the taps */
+void alsa_oss_resampler_reset(alsa_oss_resampler_t *r)
+{
+	r->fill = r->taps - 1;
+	memset(r->buf, 0, r->fill * r->channels * sizeof(*r->buf));
+	r->pos = 0;
+	r->phase = 0;
+}
+
+size_t alsa_oss_resampler_max_out(alsa_oss_resampler_t *r, size_t in_frames)
+{
+	return (in_frames * r->phases + r->step - 1) / r->step + 1;
+}
+
+size_t alsa_oss_resampler_need(alsa_oss_resampler_t *r, size_t out_frames)
+{
+	return (out_frames * r->step + r->phases - 1) / r->phases;
+}
+
+static inline int32_t clamp_s32(int64_t v)
+{
+	if (v > INT32_MAX)
+		return INT32_MAX;
+	if (v < INT32_MIN)
+		return INT32_MIN;
+	return (int32_t)v;
+}
+
+size_t alsa_oss_resampler_process(alsa_oss_resampler_t *r, int32_t *out,
+				  const int32_t *in, size_t in_frames)
+{
+	unsigned int ch = r->channels, taps = r->taps, c, k;
+	size_t n = 0, keep;
+
+	if (in_frames > r->max_in)
+		in_frames = r->max_in;
+	memcpy(r->buf + r->fill * ch, in, in_frames * ch * sizeof(*in));
+	r->fill += in_frames;
+	while (r->pos + taps <= r->fill) {
+		const int32_t *h = r->coefs + r->phase * taps;
+		const int32_t *x = r->buf + r->pos * ch;
+		if (ch == 2) {
+			int64_t a0 = 0, a1 = 0;
+			for (k = 0; k < taps; k++, x += 2) {
+				a0 += (int64_t)h[k] * x[0];
+				a1 += (int64_t)h[k] * x[1];
+			}
+			out[0] = clamp_s32(a0 >> COEF_SHIFT);
+			out[1] = clamp_s32(a1 >> COEF_SHIFT);
+		} else {
+			for (c = 0; c < ch; c++) {
+				int64_t a = 0;
+				for (k = 0; k < taps; k++)
+					a += (int64_t)h[k] * x[k * ch + c];
+				out[c] = clamp_s32(a >> COEF_SHIFT);
+			}
+		}
+		out += ch;
+		n++;
+		r->phase += r->step;
+		r->pos += r->phase / r->phases;
+		r->phase %= r->phases;
+	}
+	/* keep the window of the next output, which may start beyond what we have */
+	keep = r->pos < r->fill ? r->pos : r->fill;
+	memmove(r->buf, r->buf + keep * ch, (r->fill - keep) * ch * sizeof(*r->buf));
+	r->fill -= keep;
+	r->pos -= keep;
+	return n;
+}
@@ -0,0 +1,52 @@
+#ifndef __ALSA_OSS_RESAMPLE_H
+#define __ALSA_OSS_RESAMPLE_H
+/*
+ *  OSS -> ALSA compatibility layer
+ *  Polyphase sample rate converter
+ *
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct alsa_oss_resampler alsa_oss_resampler_t;
+
+/*
+ * Quality presets by name ("fast", "medium", "best"), 0 means off.
+ * Anything else non empty selects "medium".
+ */
+unsigned int alsa_oss_resample_quality(const char *name);
+const char *alsa_oss_resample_quality_name(unsigned int quality);
+
+/*
+ * Works on interleaved full scale s32 frames.  Each call takes at most
+ * max_in frames, consumes them all and returns the frames produced, at
+ * most alsa_oss_resampler_max_out(max_in).
+ */
+alsa_oss_resampler_t *alsa_oss_resampler_new(unsigned int in_rate, unsigned int out_rate,
+					     unsigned int channels, unsigned int quality,
+					     size_t max_in);
+void alsa_oss_resampler_free(alsa_oss_resampler_t *r);
+void alsa_oss_resampler_reset(alsa_oss_resampler_t *r);
+size_t alsa_oss_resampler_max_out(alsa_oss_resampler_t *r, size_t in_frames);
+/* input frames giving about out_frames more output */
+size_t alsa_oss_resampler_need(alsa_oss_resampler_t *r, size_t out_frames);
+size_t alsa_oss_resampler_process(alsa_oss_resampler_t *r, int32_t *out,
+				  const int32_t *in, size_t in_frames);
+
+#endif /* __ALSA_OSS_RESAMPLE_H */
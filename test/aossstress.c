@@ -0,0 +1,165 @@
+/*
+ * Stress test for the thread safety of the OSS emulation.
+ *
+ * Several threads keep opening, writing to and closing /dev/dsp while
+ * others do the same with /dev/mixer, and a last group writes to and
+ * polls a dsp fd which stays open for the whole run.  Run it through the
+ * preload library, e.g. on a machine without a sound card:
+ *
+ *	ALSA_OSS_PCM_DEVICE=null ./testaoss ./aossstress
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <linux/soundcard.h>
+
+static int loops = 200;
+static int threads = 8;
+static char *dsp_device = "/dev/dsp";
+static char *mixer_device = "/dev/mixer";
+static unsigned long failures;
+
+static void fail(const char *what)
+{
+	__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+}
+
+static void setup_dsp(int fd)
+{
+	int format = AFMT_S16_LE, channels = 2, rate = 48000;
+
+	if (ioctl(fd, SNDCTL_DSP_SETFMT, &format) < 0)
+		fail("SNDCTL_DSP_SETFMT");
+	if (ioctl(fd, SNDCTL_DSP_CHANNELS, &channels) < 0)
+		fail("SNDCTL_DSP_CHANNELS");
+	if (ioctl(fd, SNDCTL_DSP_SPEED, &rate) < 0)
+		fail("SNDCTL_DSP_SPEED");
+}
+
+static void *dsp_thread(void *arg)
+{
+	static char silence[4096];
+	int k;
+
+	(void)arg;
+	for (k = 0; k < loops; k++) {
+		int fd = open(dsp_device, O_WRONLY | O_NONBLOCK);
+		if (fd < 0) {
+			if (errno != EBUSY)
+				fail("open dsp");
+			continue;
+		}
+		setup_dsp(fd);
+		if (write(fd, silence, sizeof(silence)) < 0 && errno != EAGAIN)
+			fail("write dsp");
+		if (close(fd) < 0)
+			fail("close dsp");
+	}
+	return NULL;
+}
+
+static void *mixer_thread(void *arg)
+{
+	int k;
+
+	(void)arg;
+	for (k = 0; k < loops * 4; k++) {
+		int vol, fd = open(mixer_device, O_RDWR);
+		if (fd < 0) {
+			fail("open mixer");
+			continue;
+		}
+		if (ioctl(fd, SOUND_MIXER_READ_DEVMASK, &vol) < 0)
+			fail("SOUND_MIXER_READ_DEVMASK");
+		ioctl(fd, SOUND_MIXER_READ_PCM, &vol);
+		if (close(fd) < 0)
+			fail("close mixer");
+	}
+	return NULL;
+}
+
+static void *writer_thread(void *arg)
+{
+	static char silence[1024];
+	int fd = *(int *)arg;
+	int k;
+
+	for (k = 0; k < loops * 8; k++) {
+		struct pollfd pfd;
+		audio_buf_info info;
+
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 10) < 0)
+			fail("poll dsp");
+		if (ioctl(fd, SNDCTL_DSP_GETOSPACE, &info) < 0)
+			fail("SNDCTL_DSP_GETOSPACE");
+		if (write(fd, silence, sizeof(silence)) < 0 && errno != EAGAIN)
+			fail("write dsp");
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_option[] = {
+		{"device", 1, NULL, 'D'},
+		{"mixer", 1, NULL, 'M'},
+		{"threads", 1, NULL, 't'},
+		{"loop", 1, NULL, 'L'},
+		{NULL, 0, NULL, 0},
+	};
+	pthread_t *tids;
+	int c, k, fd;
+
+	while ((c = getopt_long(argc, argv, "D:M:t:L:", long_option, NULL)) >= 0) {
+		switch (c) {
+		case 'D':
+			dsp_device = optarg;
+			break;
+		case 'M':
+			mixer_device = optarg;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'L':
+			loops = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: aossstress [-D dsp] [-M mixer] [-t threads] [-L loops]\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if (threads < 1)
+		threads = 1;
+	fd = open(dsp_device, O_WRONLY | O_NONBLOCK);
+	if (fd < 0) {
+		perror("open");
+		return EXIT_FAILURE;
+	}
+	setup_dsp(fd);
+	tids = calloc(threads * 3, sizeof(*tids));
+	if (!tids)
+		return EXIT_FAILURE;
+	for (k = 0; k < threads; k++) {
+		pthread_create(&tids[k * 3], NULL, dsp_thread, NULL);
+		pthread_create(&tids[k * 3 + 1], NULL, mixer_thread, NULL);
+		pthread_create(&tids[k * 3 + 2], NULL, writer_thread, &fd);
+	}
+	for (k = 0; k < threads * 3; k++)
+		pthread_join(tids[k], NULL);
+	close(fd);
+	free(tids);
+	printf("%d threads x %d loops, %lu failures\n", threads * 3, loops, failures);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
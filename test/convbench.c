@@ -0,0 +1,79 @@
+/*
+ * Throughput of the sample conversion kernels, for every kernel set the
+ * CPU can run.  The figure is GB/s of input consumed, over a buffer sized
+ * like a 64 channel 96kHz stream worth of 10ms periods.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <convert.h>
+
+#define SAMPLES		(64 * 960)
+#define MIN_TIME	0.2
+
+static const struct {
+	const char *name;
+	size_t offset;
+	unsigned int src_bytes;
+} kernels[] = {
+#define K(name, bytes) { #name, offsetof(alsa_oss_convert_kernels_t, name), bytes }
+	K(s16_swap, 2),
+	K(u8_to_s16, 1),
+	K(s16_to_u8, 2),
+	K(s16_to_s32, 2),
+	K(s32_to_s16, 4),
+	K(s16_to_float, 2),
+	K(ulaw_to_s16, 1),
+#undef K
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	const alsa_oss_convert_kernels_t *const *sets = alsa_oss_convert_kernel_sets();
+	unsigned char *src, *dst;
+	unsigned int k, s;
+
+	src = malloc(SAMPLES * 4);
+	dst = malloc(SAMPLES * 4);
+	if (!src || !dst)
+		return EXIT_FAILURE;
+	srand(1);
+	for (k = 0; k < SAMPLES * 4; k++)
+		src[k] = rand();
+	printf("%-14s", "kernel");
+	for (s = 0; sets[s]; s++)
+		printf(" %10s", sets[s]->name);
+	printf("   (GB/s of input)\n");
+	for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		printf("%-14s", kernels[k].name);
+		for (s = 0; sets[s]; s++) {
+			alsa_oss_convert_kernel_t f =
+				*(const alsa_oss_convert_kernel_t *)((const char *)sets[s] + kernels[k].offset);
+			unsigned long loops = 0;
+			double t0, t1;
+
+			f(dst, src, SAMPLES);	/* warm up */
+			t0 = now();
+			do {
+				f(dst, src, SAMPLES);
+				loops++;
+				t1 = now();
+			} while (t1 - t0 < MIN_TIME);
+			printf(" %10.2f", (double)loops * SAMPLES * kernels[k].src_bytes / (t1 - t0) / 1e9);
+		}
+		printf("\n");
+	}
+	free(src);
+	free(dst);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,88 @@
+/*
+ * Micro-benchmark of the fd -> state lookup used by the dsp/mixer emulation.
+ * The old singly linked list walk is timed next to the fd table so that the
+ * flat lookup cost is visible when the count of open fds grows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fdtable.h>
+
+#define LOOKUPS		(1 << 22)
+
+struct node {
+	int fileno;
+	struct node *next;
+};
+
+static struct node *list_head;
+
+static struct node *list_lookup(int fd)
+{
+	struct node *n = list_head;
+	while (n) {
+		if (n->fileno == fd)
+			return n;
+		n = n->next;
+	}
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	static const int counts[] = { 1, 10, 100, 1000 };
+	unsigned int k, i;
+	int *order;
+
+	order = malloc(LOOKUPS * sizeof(*order));
+	if (!order)
+		return EXIT_FAILURE;
+	printf("%8s %14s %14s\n", "open fds", "list ns/op", "table ns/op");
+	for (k = 0; k < sizeof(counts) / sizeof(counts[0]); k++) {
+		int count = counts[k];
+		fd_table_t table = FD_TABLE_INITIALIZER;
+		struct node *nodes = calloc(count, sizeof(*nodes));
+		unsigned long hits = 0;
+		double t0, t1, t2;
+
+		if (!nodes)
+			return EXIT_FAILURE;
+		list_head = NULL;
+		for (i = 0; i < (unsigned int)count; i++) {
+			/* spread the fds like a busy process would */
+			nodes[i].fileno = 3 + i * 7;
+			nodes[i].next = list_head;
+			list_head = &nodes[i];
+			if (fd_table_set(&table, nodes[i].fileno, &nodes[i]) < 0)
+				return EXIT_FAILURE;
+		}
+		srand(count);
+		for (i = 0; i < LOOKUPS; i++)
+			order[i] = nodes[rand() % count].fileno;
+
+		t0 = now();
+		for (i = 0; i < LOOKUPS; i++)
+			hits += list_lookup(order[i]) != NULL;
+		t1 = now();
+		for (i = 0; i < LOOKUPS; i++)
+			hits += fd_table_get(&table, order[i]) != NULL;
+		t2 = now();
+		if (hits != 2UL * LOOKUPS)
+			return EXIT_FAILURE;
+		printf("%8d %14.2f %14.2f\n", count,
+		       (t1 - t0) * 1e9 / LOOKUPS, (t2 - t1) * 1e9 / LOOKUPS);
+		for (i = 0; i < (unsigned int)count; i++)
+			fd_table_clear(&table, nodes[i].fileno);
+		free(nodes);
+	}
+	free(order);
+	return EXIT_SUCCESS;
+}